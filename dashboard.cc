@@ -30,6 +30,9 @@ SOFTWARE.
 #include "../Bricks/dflags/dflags.h"
 
 DEFINE_int32(port, 8191, "Local port to use.");
+DEFINE_int32(listener_threads, 4, "The number of threads to serve the subscribers to the data with.");
+DEFINE_string(persistence_dir, "", "The existing directory to persist the streams in. In-memory if empty.");
+DEFINE_int32(entries_in_memory, 10000, "The number of the most recent entries of persisted streams in memory.");
 
 template <typename Y>
 struct VizPoint {
@@ -205,8 +208,15 @@ struct Layout {
 using layout::Layout;
 
 int main() {
-  auto time_series = sherlock::Stream<DoublePoint>("time_series");
-  auto pic_series = sherlock::Stream<StringPoint>("pic_series");
+  // Persisted streams only keep the most recent entries in memory, so that the memory used stays flat.
+  sherlock::Persistence persistence(FLAGS_persistence_dir);
+  persistence.policy.max_entries_per_file = static_cast<uint64_t>(FLAGS_entries_in_memory);
+  persistence.memory.max_entries = static_cast<uint64_t>(FLAGS_entries_in_memory);
+  auto time_series = FLAGS_persistence_dir.empty()
+                         ? sherlock::Stream<DoublePoint>("time_series")
+                         : sherlock::Stream<DoublePoint>("time_series", persistence);
+  auto pic_series = FLAGS_persistence_dir.empty() ? sherlock::Stream<StringPoint>("pic_series")
+                                                  : sherlock::Stream<StringPoint>("pic_series", persistence);
 
   std::thread points_populator([&time_series, &pic_series]() {
     while (true) {
@@ -229,6 +239,9 @@ int main() {
 
   const int port = FLAGS_port;
 
+  // The browsers keep their subscriptions open, so they should not cost a thread each.
+  sherlock::scheduler::WorkerPool listeners_pool(FLAGS_listener_threads);
+
   HTTP(port).Register("/config", [](Request r) {
     r(ExampleConfig(),
       "config",
@@ -237,12 +250,14 @@ int main() {
       HTTPHeaders({{"Access-Control-Allow-Origin", "*"}}));
   });
 
-  HTTP(port).Register("/layout/plot_data", [&time_series](Request r) {
-    time_series.AsyncSubscribe(make_unique<ServeJSONOverHTTP<DoublePoint> >(std::move(r))).Detach();
+  HTTP(port).Register("/layout/plot_data", [&time_series, &listeners_pool](Request r) {
+    time_series.AsyncSubscribe(make_unique<ServeJSONOverHTTP<DoublePoint> >(std::move(r)), listeners_pool)
+        .Detach();
   });
 
-  HTTP(port).Register("/layout/pic_data", [&pic_series](Request r) {
-    pic_series.AsyncSubscribe(make_unique<ServeJSONOverHTTP<StringPoint> >(std::move(r))).Detach();
+  HTTP(port).Register("/layout/pic_data", [&pic_series, &listeners_pool](Request r) {
+    pic_series.AsyncSubscribe(make_unique<ServeJSONOverHTTP<StringPoint> >(std::move(r)), listeners_pool)
+        .Detach();
   });
 
   HTTP(port).Register("/layout/plot_meta", [](Request r) {
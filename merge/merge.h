@@ -0,0 +1,283 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Listens to many streams of the same type at once, passing their entries to one listener in the order of
+// their order keys, see `OrderKey()`. The entries with the same order key are passed in the order of the
+// streams they come from, and the entries of each stream in the order they have been published in.
+//
+// One thread serves all the streams. Each stream has at most one entry in the heap of the entries to pass,
+// its next one, which is read in place, from memory or from the chunk of the history read most recently,
+// so no entries are copied. A stream that has no entries to pass at the moment holds the others back:
+// its next entry may precede theirs. It lets them go once it publishes one, or once it moves its head on
+// past them, see `UpdateHead()`. Thus, the sparse streams should have their heads updated regularly.
+//
+// The listener should expose the following member functions:
+//
+//   1) `bool MergedEntry(const T& entry, size_t source, size_t index)`:
+//      The entry with the index of `index` in the stream `streams[source]`. Returning `false` stops the merge.
+//
+//   2) `void HeadUpdated(EPOCH_MILLISECONDS head)`:
+//      Optional. Called once all the entries with the order keys before `head` have been passed, and no
+//      more will follow, if it is past the order key of the entry passed last. See `HeadUpdated()` in
+//      `sherlock.h`: the head of the merge is the earliest one of the streams.
+//
+//   3) `void Terminate()` or `bool Terminate()`:
+//      Optional. Called once the scope of the merge is destroyed or joined, or once any of the streams
+//      is shut down. The semantics are the same as for the listeners of one stream.
+
+#ifndef SHERLOCK_MERGE_MERGE_H
+#define SHERLOCK_MERGE_MERGE_H
+
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../sherlock.h"
+
+#include "../scheduler/wakeup.h"
+
+namespace sherlock {
+namespace merge {
+
+// Runs the merge of `streams` into `listener` for as long as the scope lives, from the very first entries.
+// Same as `SyncListenerScope`, destroying or joining the scope has the listener terminate and waits for it.
+template <typename T, typename F>
+class MergedListenerScope final {
+ public:
+  MergedListenerScope(const std::vector<StreamInstance<T>>& streams, F& listener)
+      : streams_(streams),
+        listener_(listener),
+        wakeup_(std::make_shared<scheduler::Event>()),
+        external_termination_request_(false) {
+    for (size_t i = 0; i < streams_.size(); ++i) {
+      sources_.push_back(make_unique<Source>(streams_[i].impl_->Data(), wakeup_));
+    }
+    thread_ = std::thread(&MergedListenerScope::Thread, this);
+  }
+
+  ~MergedListenerScope() {
+    if (thread_.joinable()) {
+      Join();
+    }
+  }
+
+  void Join() {
+    assert(thread_.joinable());
+    external_termination_request_ = true;
+    wakeup_->Wake();
+    thread_.join();
+  }
+
+ private:
+  // The position of the entry in the merged order.
+  typedef std::pair<uint64_t, size_t> Position;
+
+  // The entry to pass next from the source, which stays where it is until the source is looked at again.
+  struct Pending {
+    Position position;
+    const T* entry;
+  };
+
+  // Past any position, for when there is nothing to bound the positions of the entries to pass by.
+  static Position NoBound() {
+    return Position(std::numeric_limits<uint64_t>::max(), std::numeric_limits<size_t>::max());
+  }
+
+  struct Later {
+    bool operator()(const Pending& lhs, const Pending& rhs) const { return rhs.position < lhs.position; }
+  };
+
+  // Registered with the stream of each source that the merge waits for, for all of them to wake up
+  // the one thread. It is not registered again until woken up, so the idle streams do not pile it up.
+  class SourceWakeup final : public scheduler::Wakeable,
+                             public std::enable_shared_from_this<SourceWakeup> {
+   public:
+    explicit SourceWakeup(std::shared_ptr<scheduler::Event> event)
+        : event_(std::move(event)), registered_(false) {}
+
+    void Wake() override {
+      registered_ = false;
+      event_->Wake();
+    }
+
+    void WakeUpWhenAvailable(StreamData<T>& data,
+                             size_t cursor,
+                             bool or_on_shutdown,
+                             uint64_t or_on_head_past) {
+      if (!registered_.exchange(true)) {
+        data.WakeUpWhenAvailable(cursor, this->shared_from_this(), or_on_shutdown, or_on_head_past);
+      }
+    }
+
+   private:
+    const std::shared_ptr<scheduler::Event> event_;
+    std::atomic_bool registered_;
+  };
+
+  struct Source final {
+    StreamData<T>& data;
+    size_t cursor;
+    bool pending;
+    // The order key of the entry passed last, which the next one can not precede.
+    uint64_t last_order_key;
+    std::unique_ptr<HistoryReplay<T>> history;
+    typename StreamData<T>::ListenerProgress progress;
+    const std::shared_ptr<SourceWakeup> wakeup;
+
+    Source(StreamData<T>& data, std::shared_ptr<scheduler::Event> event)
+        : data(data),
+          cursor(0u),
+          pending(false),
+          last_order_key(0u),
+          history(make_unique<HistoryReplay<T>>(data)),
+          progress(0u, SlowListenerPolicy()),
+          wakeup(std::make_shared<SourceWakeup>(std::move(event))) {
+      data.ListenerStarted(progress);
+    }
+
+    const T& Next() {
+      if (history->InHistory(cursor)) {
+        const std::vector<T>& chunk = history->Chunk(cursor);
+        return chunk[cursor - history->Begin()];
+      }
+      return data[cursor];
+    }
+
+    // The earliest position the entries of this source yet to be published can take.
+    Position Bound(size_t source) const {
+      return Position(std::max(last_order_key, data.HeadPast(cursor, 0u)), source);
+    }
+  };
+
+  bool TerminationRequested() const {
+    if (external_termination_request_) {
+      return true;
+    }
+    for (const auto& source : sources_) {
+      if (source->data.ShutdownRequested()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Thread() {
+    RunListener();
+    // Only now the streams can be gone, as the history replays of this listener have been destroyed.
+    for (const auto& source : sources_) {
+      source->history.reset();
+      source->data.ListenerDone(source->progress);
+    }
+  }
+
+  void RunListener() {
+    PretendingToBeUniquePtr<F> listener(listener_);
+    std::priority_queue<Pending, std::vector<Pending>, Later> heap;
+    uint64_t last_order_key = 0u;
+    uint64_t head_passed = 0u;
+    bool user_already_notified_to_terminate = false;
+    while (true) {
+      if (!user_already_notified_to_terminate && TerminationRequested()) {
+        user_already_notified_to_terminate = true;
+        if (CallTerminate(listener)) {
+          return;
+        }
+      }
+      // The entries in the heap can be passed as long as they precede the bounds of the idle sources.
+      Position bound = NoBound();
+      for (size_t i = 0; i < sources_.size(); ++i) {
+        if (!sources_[i]->pending) {
+          bound = std::min(bound, AddToHeapOrBound(i, heap));
+        }
+      }
+      while (!heap.empty() && heap.top().position < bound) {
+        const Pending next = heap.top();
+        heap.pop();
+        const size_t i = next.position.second;
+        Source& source = *sources_[i];
+        source.pending = false;
+        last_order_key = source.last_order_key = next.position.first;
+        if (!listener->MergedEntry(*next.entry, i, source.cursor++)) {
+          return;
+        }
+        source.data.ListenerProgressed(source.progress, source.cursor, false);
+        bound = std::min(bound, AddToHeapOrBound(i, heap));
+      }
+      // The entries left in the heap, if any, do not precede the bound either, so it is the head of the merge.
+      if (HasHeadUpdatedMethod<PretendingToBeUniquePtr<F>&>(0)) {
+        const uint64_t head = bound.first;
+        if (head != NoBound().first && head > std::max(head_passed, last_order_key)) {
+          head_passed = head;
+          CallHeadUpdated(listener, static_cast<bricks::time::EPOCH_MILLISECONDS>(head));
+        }
+      }
+      if (user_already_notified_to_terminate || !TerminationRequested()) {
+        // The sources with entries in the heap are only waited for to learn about their shutdown,
+        // which wakes the merge up once per publish of theirs at most.
+        for (size_t i = 0; i < sources_.size(); ++i) {
+          Source& source = *sources_[i];
+          const size_t cursor = source.pending ? std::numeric_limits<size_t>::max() : source.cursor;
+          source.wakeup->WakeUpWhenAvailable(
+              source.data, cursor, !user_already_notified_to_terminate, source.Bound(i).first);
+        }
+        wakeup_->Wait();
+      }
+    }
+  }
+
+  // Adds the next entry of the source to the heap if it has been published, and returns `NoBound()`.
+  // Otherwise, returns the bound of the source.
+  Position AddToHeapOrBound(size_t i, std::priority_queue<Pending, std::vector<Pending>, Later>& heap) {
+    Source& source = *sources_[i];
+    if (source.data.Size() > source.cursor) {
+      const T& entry = source.Next();
+      heap.push(Pending{Position(OrderKey(entry, source.cursor), i), &entry});
+      source.pending = true;
+      return NoBound();
+    }
+    return source.Bound(i);
+  }
+
+  // The streams are kept alive for as long as the merge looks at them.
+  const std::vector<StreamInstance<T>> streams_;
+  F& listener_;
+  const std::shared_ptr<scheduler::Event> wakeup_;
+  std::atomic_bool external_termination_request_;
+  std::vector<std::unique_ptr<Source>> sources_;
+  std::thread thread_;
+
+  MergedListenerScope(const MergedListenerScope&) = delete;
+  MergedListenerScope(MergedListenerScope&&) = delete;
+  void operator=(const MergedListenerScope&) = delete;
+  void operator=(MergedListenerScope&&) = delete;
+};
+
+}  // namespace merge
+}  // namespace sherlock
+
+#endif  // SHERLOCK_MERGE_MERGE_H
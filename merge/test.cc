@@ -0,0 +1,132 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+#include "merge.h"
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../Bricks/strings/util.h"
+#include "../../Bricks/time/chrono.h"
+
+#include "../../Bricks/dflags/dflags.h"
+#include "../../Bricks/3party/gtest/gtest-main-with-dflags.h"
+
+using sherlock::merge::MergedListenerScope;
+
+struct Timestamped {
+  uint64_t t_;
+  Timestamped(uint64_t t = 0u) : t_(t) {}
+  template <typename A>
+  void serialize(A& ar) {
+    ar(cereal::make_nvp("t", t_));
+  }
+  bricks::time::EPOCH_MILLISECONDS ExtractTimestamp() const {
+    return static_cast<bricks::time::EPOCH_MILLISECONDS>(t_);
+  }
+};
+
+// Collects the entries as "source:index@timestamp", and the heads as "head@timestamp".
+struct MergeCollector {
+  std::mutex mutex_;
+  std::vector<std::string> events_;
+  bool terminated_ = false;
+  bool MergedEntry(const Timestamped& entry, size_t source, size_t index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back(bricks::strings::Printf("%d:%d@%d",
+                                              static_cast<int>(source),
+                                              static_cast<int>(index),
+                                              static_cast<int>(entry.t_)));
+    return true;
+  }
+  void HeadUpdated(bricks::time::EPOCH_MILLISECONDS head) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back(bricks::strings::Printf("head@%d", static_cast<int>(head)));
+  }
+  void Terminate() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    terminated_ = true;
+  }
+  std::string WaitFor(size_t n) {
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (events_.size() >= n) {
+          std::string result;
+          for (const std::string& event : events_) {
+            result += (result.empty() ? "" : ",") + event;
+          }
+          return result;
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+};
+
+TEST(Merge, EntriesArePassedInOrderOfTheirTimestamps) {
+  auto a = sherlock::Stream<Timestamped>("merge_a");
+  auto b = sherlock::Stream<Timestamped>("merge_b");
+  a.Publish(Timestamped(1));
+  a.Publish(Timestamped(3));
+  b.Publish(Timestamped(2));
+  MergeCollector collector;
+  MergedListenerScope<Timestamped, MergeCollector> scope({a, b}, collector);
+
+  // Stream `b` may yet publish an entry timestamped 2, so the one of `a` timestamped 3 waits for it.
+  EXPECT_EQ("0:0@1,1:0@2", collector.WaitFor(2u));
+  b.Publish(Timestamped(4));
+  EXPECT_EQ("0:0@1,1:0@2,0:1@3", collector.WaitFor(3u));
+
+  // The entries with the same timestamp are passed in the order of the streams, so the one of `b` waits
+  // for `a` to move past it.
+  a.Publish(Timestamped(4));
+  EXPECT_EQ("0:0@1,1:0@2,0:1@3,0:2@4", collector.WaitFor(4u));
+  a.Publish(Timestamped(5));
+  EXPECT_EQ("0:0@1,1:0@2,0:1@3,0:2@4,1:1@4", collector.WaitFor(5u));
+
+  // A sparse stream lets the others go by moving its head on.
+  a.Publish(Timestamped(6));
+  b.UpdateHead(bricks::time::EPOCH_MILLISECONDS(10));
+  EXPECT_EQ("0:0@1,1:0@2,0:1@3,0:2@4,1:1@4,0:3@5,0:4@6", collector.WaitFor(7u));
+  a.UpdateHead(bricks::time::EPOCH_MILLISECONDS(20));
+  EXPECT_EQ("0:0@1,1:0@2,0:1@3,0:2@4,1:1@4,0:3@5,0:4@6,head@10", collector.WaitFor(8u));
+  scope.Join();
+  EXPECT_TRUE(collector.terminated_);
+}
+
+TEST(Merge, ShutdownOfAnyStreamTerminatesTheMerge) {
+  auto a = sherlock::Stream<Timestamped>("merge_shutdown_a");
+  auto b = sherlock::Stream<Timestamped>("merge_shutdown_b");
+  a.Publish(Timestamped(1));
+  a.Publish(Timestamped(2));
+  MergeCollector collector;
+  MergedListenerScope<Timestamped, MergeCollector> scope({a, b}, collector);
+  sherlock::Streams().Shutdown("merge_shutdown_b");
+  std::lock_guard<std::mutex> lock(collector.mutex_);
+  EXPECT_TRUE(collector.terminated_);
+  EXPECT_TRUE(collector.events_.empty());
+}
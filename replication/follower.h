@@ -0,0 +1,220 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Replicates the stream from its authority, the binary it is published into, into the local stream.
+//
+// The follower requests the entries from the index that is the first one not yet published into the local
+// stream, and publishes them into it as they come. Thus, it resumes where it left off if the local stream is
+// persistent, as the stream picks up the entries replicated before the restart.
+//
+// The follower should be the only publisher into the local stream, and the local stream should only contain
+// the entries replicated from the authority, so that their indexes match.
+//
+// The entries are polled in batches via `?from=...&cap=...&nowait`, so that each request completes promptly,
+// and are transferred in the binary format, see `BinaryEntry()`. Each batch is published at once,
+// see `PublishBatch()`, and the follower waits for `poll_interval` before asking again once it has caught up,
+// or once the authority can not be reached. Other errors, such as entries that can not be parsed or stored,
+// would not go away by asking again, so the follower stops replicating on them, see `Error()`.
+//
+// The entries are polled rather than streamed via a single long-lived chunked response, as the HTTP client
+// only returns the response once it has been read completely.
+//
+// The HTTP client has no timeouts, so the request in progress, if any, is left to complete by itself once
+// the follower is destroyed, see `Request()`. The process must not exit while it is pending, as it would then
+// use the HTTP client while it is being destroyed.
+
+#ifndef SHERLOCK_REPLICATION_FOLLOWER_H
+#define SHERLOCK_REPLICATION_FOLLOWER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../sherlock.h"
+
+#include "../../Bricks/net/api/api.h"
+
+namespace sherlock {
+namespace replication {
+
+struct FollowerPolicy {
+  // The most entries requested at once.
+  size_t max_entries_per_request = 10000u;
+  // How long to wait before asking for more once caught up, or once the authority can not be reached.
+  std::chrono::milliseconds poll_interval = std::chrono::milliseconds(100);
+  // How long to wait for the authority to respond before asking again.
+  std::chrono::milliseconds request_timeout = std::chrono::milliseconds(10000);
+};
+
+template <typename T>
+class Follower final {
+ public:
+  // `url` is the endpoint the authority exposes the stream at, ex. "http://localhost:8080/my_stream".
+  Follower(StreamInstance<T> stream, const std::string& url, const FollowerPolicy& policy = FollowerPolicy())
+      : stream_(std::move(stream)),
+        url_(url),
+        policy_(policy),
+        state_(std::make_shared<State>()),
+        thread_(&Follower::Thread, this) {}
+
+  // Does not wait for the request in progress, if any, see above.
+  ~Follower() {
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      state_->stop = true;
+    }
+    state_->condition_variable.notify_all();
+    thread_.join();
+  }
+
+  // Why the follower has stopped replicating, or an empty string while it is replicating.
+  std::string Error() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return error_;
+  }
+
+ private:
+  // Shared with the threads the requests are made from, as those may outlive the follower.
+  struct State {
+    std::mutex mutex;
+    std::condition_variable condition_variable;
+    std::atomic_bool stop{false};
+  };
+
+  struct Response {
+    bool done = false;
+    bool ok = false;
+    std::string body;
+    std::exception_ptr error;
+  };
+
+  void Thread() {
+    while (!state_->stop) {
+      bool caught_up = true;
+      try {
+        caught_up = ReplicateOneBatch() < policy_.max_entries_per_request;
+      } catch (const StreamIsShutDownException&) {
+        return;
+      } catch (const bricks::net::NetworkException&) {
+        // Keep trying.
+      } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        error_ = "Replicating from `" + url_ + "` failed: " + e.what();
+        return;
+      }
+      if (caught_up) {
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        state_->condition_variable.wait_for(
+            lock, policy_.poll_interval, [this]() { return state_->stop.load(); });
+      }
+    }
+  }
+
+  // Returns the number of entries replicated.
+  size_t ReplicateOneBatch() {
+    const size_t from = stream_.Size();
+    std::string body;
+    if (!Request(url_ + "?from=" + std::to_string(from) + "&cap=" +
+                     std::to_string(policy_.max_entries_per_request) + "&nowait&format=binary",
+                 body)) {
+      return 0u;
+    }
+    // The response may end with an incomplete entry if the connection was lost, which is then ignored.
+    std::vector<T> entries;
+    BinaryEntriesReader<T> reader;
+    reader.Feed(body, [&entries](T&& entry) { entries.push_back(std::move(entry)); });
+    stream_.PublishBatch(std::make_move_iterator(entries.begin()), std::make_move_iterator(entries.end()));
+    return entries.size();
+  }
+
+  // The HTTP client can not be interrupted, so the request is made from a thread of its own, which is left
+  // to complete by itself if the response does not come within `request_timeout`, or if the follower is
+  // stopped meanwhile. Returns false unless a successful response has come in time, with `body` set to it.
+  // If the response has not come, it is waited for again next time instead of making another request,
+  // for at most one to be in progress. It is the response for the same `url`, as nothing has been published
+  // into the local stream meanwhile.
+  bool Request(const std::string& url, std::string& body) {
+    if (!in_progress_) {
+      in_progress_ = std::make_shared<Response>();
+      MakeRequest(state_, in_progress_, url);
+    }
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->condition_variable.wait_for(
+        lock, policy_.request_timeout, [this]() { return state_->stop.load() || in_progress_->done; });
+    if (!in_progress_->done) {
+      return false;
+    }
+    const std::shared_ptr<Response> response = std::move(in_progress_);  // Leaves `in_progress_` empty.
+    if (response->error) {
+      std::rethrow_exception(response->error);
+    }
+    body = std::move(response->body);
+    return response->ok;
+  }
+
+  static void MakeRequest(std::shared_ptr<State> state,
+                          std::shared_ptr<Response> response,
+                          const std::string& url) {
+    std::thread([state, response, url]() {
+      Response result;
+      try {
+        auto http_response = HTTP(GET(url));
+        result.ok = (http_response.code == HTTPResponseCode.OK);
+        result.body = std::move(http_response.body);
+      } catch (...) {
+        result.error = std::current_exception();
+      }
+      result.done = true;
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        *response = std::move(result);
+      }
+      state->condition_variable.notify_all();
+    }).detach();
+  }
+
+  StreamInstance<T> stream_;
+  const std::string url_;
+  const FollowerPolicy policy_;
+  const std::shared_ptr<State> state_;
+  std::shared_ptr<Response> in_progress_;  // Only used by the follower thread.
+  std::string error_;
+  std::thread thread_;
+
+  Follower(const Follower&) = delete;
+  Follower(Follower&&) = delete;
+  void operator=(const Follower&) = delete;
+  void operator=(Follower&&) = delete;
+};
+
+}  // namespace replication
+}  // namespace sherlock
+
+#endif  // SHERLOCK_REPLICATION_FOLLOWER_H
@@ -0,0 +1,185 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+#include "follower.h"
+#include "../storage/testing.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../Bricks/file/file.h"
+#include "../../Bricks/net/api/api.h"
+#include "../../Bricks/strings/util.h"
+#include "../../Bricks/time/chrono.h"
+
+#include "../../Bricks/dflags/dflags.h"
+#include "../../Bricks/3party/gtest/gtest-main-with-dflags.h"
+
+DEFINE_int32(sherlock_replication_test_port, 8091, "Local port to use for the replication test.");
+DEFINE_string(sherlock_replication_test_tmpdir,
+              ".noshit",
+              "Local path for the test to create temporary files in.");
+
+using sherlock::replication::Follower;
+using sherlock::replication::FollowerPolicy;
+using sherlock::storage::CleanTestDirectory;
+
+struct Replicated {
+  int x_;
+  std::string s_;
+  Replicated(int x = 0, const std::string& s = "") : x_(x), s_(s) {}
+  template <typename A>
+  void serialize(A& ar) {
+    ar(cereal::make_nvp("x", x_), cereal::make_nvp("s", s_));
+  }
+  bricks::time::EPOCH_MILLISECONDS ExtractTimestamp() const {
+    return static_cast<bricks::time::EPOCH_MILLISECONDS>(x_);
+  }
+};
+
+// Collects all the entries of the stream, to compare the replica against the authority.
+inline std::string AllEntries(sherlock::StreamInstance<Replicated>& stream) {
+  struct Collector {
+    const size_t size_;
+    std::string results_;
+    explicit Collector(size_t size) : size_(size) {}
+    bool Entry(const Replicated& entry, size_t index, size_t) {
+      results_ += bricks::strings::Printf("%s%d:%s", results_.empty() ? "" : ",", entry.x_, entry.s_.c_str());
+      return index + 1 < size_;
+    }
+    bool Terminate() { return false; }
+  };
+  Collector collector(stream.Size());
+  if (collector.size_) {
+    stream.SyncSubscribe(collector).Join();
+  }
+  return collector.results_;
+}
+
+inline void WaitForSize(const sherlock::StreamInstance<Replicated>& stream, size_t size) {
+  while (stream.Size() < size) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+TEST(Replication, FollowerCatchesUpAndResumesAfterRestart) {
+  CleanTestDirectory(FLAGS_sherlock_replication_test_tmpdir, "replica");
+
+  auto authority = sherlock::Stream<Replicated>("authority");
+  HTTP(FLAGS_sherlock_replication_test_port).ResetAllHandlers();
+  HTTP(FLAGS_sherlock_replication_test_port).Register("/authority", authority);
+  const std::string url =
+      bricks::strings::Printf("http://localhost:%d/authority", FLAGS_sherlock_replication_test_port);
+
+  // Small requests, to have the follower catch up in several of them.
+  FollowerPolicy policy;
+  policy.max_entries_per_request = 3u;
+  policy.poll_interval = std::chrono::milliseconds(1);
+
+  for (int i = 0; i < 5; ++i) {
+    authority.Publish(Replicated(i, "before"));
+  }
+  {
+    auto replica =
+        sherlock::Stream<Replicated>("replica", sherlock::Persistence(FLAGS_sherlock_replication_test_tmpdir));
+    Follower<Replicated> follower(replica, url, policy);
+    WaitForSize(replica, 5u);
+    for (int i = 5; i < 8; ++i) {
+      authority.Publish(Replicated(i, "while"));
+    }
+    WaitForSize(replica, 8u);
+  }
+  sherlock::Streams().Shutdown("replica");
+
+  // The restarted follower only requests the entries published while it was down.
+  for (int i = 8; i < 10; ++i) {
+    authority.Publish(Replicated(i, "after"));
+  }
+  auto replica =
+      sherlock::Stream<Replicated>("replica", sherlock::Persistence(FLAGS_sherlock_replication_test_tmpdir));
+  EXPECT_EQ(8u, replica.Size());
+  {
+    Follower<Replicated> follower(replica, url, policy);
+    WaitForSize(replica, 10u);
+  }
+  EXPECT_EQ(10u, replica.Size());
+  EXPECT_EQ(AllEntries(authority), AllEntries(replica));
+  EXPECT_EQ("0:before,1:before,2:before,3:before,4:before,5:while,6:while,7:while,8:after,9:after",
+            AllEntries(replica));
+}
+
+TEST(Replication, FollowerStopsOnEntriesItCanNotParse) {
+  HTTP(FLAGS_sherlock_replication_test_port).ResetAllHandlers();
+  // A single entry with a one-byte payload, which is too short for `Replicated`.
+  HTTP(FLAGS_sherlock_replication_test_port)
+      .Register("/garbage", [](Request r) { r(std::string("\x01\x00\x00\x00x", 5)); });
+  const std::string url =
+      bricks::strings::Printf("http://localhost:%d/garbage", FLAGS_sherlock_replication_test_port);
+
+  FollowerPolicy policy;
+  policy.poll_interval = std::chrono::milliseconds(1);
+  auto replica = sherlock::Stream<Replicated>("unparsable");
+  Follower<Replicated> follower(replica, url, policy);
+  while (follower.Error().empty()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(0u, replica.Size());
+  EXPECT_EQ(0u, follower.Error().find("Replicating from `" + url + "` failed: "));
+}
+
+TEST(Replication, FollowerStopsWithoutWaitingForTheResponse) {
+  HTTP(FLAGS_sherlock_replication_test_port).ResetAllHandlers();
+  HTTP(FLAGS_sherlock_replication_test_port).Register("/slow", [](Request r) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    r("");
+  });
+  const std::string url =
+      bricks::strings::Printf("http://localhost:%d/slow", FLAGS_sherlock_replication_test_port);
+
+  auto replica = sherlock::Stream<Replicated>("slow");
+  const auto begin = bricks::time::Now();
+  {
+    Follower<Replicated> follower(replica, url);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  // Loose, so that only waiting for the response fails the test.
+  EXPECT_LT(static_cast<uint64_t>(bricks::time::Now() - begin), 500u);
+  EXPECT_EQ(0u, replica.Size());
+}
+
+TEST(Replication, HTTPEndpointEndsResponseOnceCaughtUpWithNoWait) {
+  auto stream = sherlock::Stream<Replicated>("nowait");
+  HTTP(FLAGS_sherlock_replication_test_port).ResetAllHandlers();
+  HTTP(FLAGS_sherlock_replication_test_port).Register("/nowait", stream);
+  const std::string url =
+      bricks::strings::Printf("http://localhost:%d/nowait", FLAGS_sherlock_replication_test_port);
+  EXPECT_EQ("", HTTP(GET(url + "?nowait")).body);
+  stream.Publish(Replicated(1, "one"));
+  stream.Publish(Replicated(2, "two"));
+  EXPECT_EQ(JSON(Replicated(1, "one"), "entry") + '\n' + JSON(Replicated(2, "two"), "entry") + '\n',
+            HTTP(GET(url + "?nowait")).body);
+  EXPECT_EQ(JSON(Replicated(2, "two"), "entry") + '\n', HTTP(GET(url + "?from=1&nowait")).body);
+  EXPECT_EQ("", HTTP(GET(url + "?from=2&nowait")).body);
+}
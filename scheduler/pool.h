@@ -0,0 +1,169 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// The pool of worker threads to run Sherlock listeners on, as opposed to running each one in its own thread.
+//
+// The listeners are event-driven: a listener that has caught up with its stream is not run at all, and costs
+// no thread, until the stream wakes it up by scheduling it on the pool again. Thus, a few workers can serve
+// thousands of listeners, as long as the listeners themselves do not block for long.
+//
+// The order in which each listener sees the entries is preserved, since it is never run by more than one
+// worker at a time, see `SerialTask`.
+
+#ifndef SHERLOCK_SCHEDULER_POOL_H
+#define SHERLOCK_SCHEDULER_POOL_H
+
+#include "../../Bricks/port.h"
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "wakeup.h"
+
+namespace sherlock {
+namespace scheduler {
+
+class Task {
+ public:
+  virtual ~Task() = default;
+  virtual void Run() = 0;
+};
+
+// Runs the scheduled tasks in the order they have been scheduled, on a fixed number of worker threads.
+// The pool must outlive all the tasks scheduled on it, including the ones that may schedule themselves again.
+class WorkerPool final {
+ public:
+  explicit WorkerPool(size_t threads) : stopping_(false) {
+    assert(threads);
+    for (size_t i = 0; i < threads; ++i) {
+      workers_.emplace_back(&WorkerPool::Worker, this);
+    }
+  }
+
+  // The tasks that have not been run yet are dropped.
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    condition_variable_.notify_all();
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  size_t Threads() const { return workers_.size(); }
+
+  void Schedule(std::shared_ptr<Task> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(task));
+    }
+    condition_variable_.notify_one();
+  }
+
+ private:
+  void Worker() {
+    while (true) {
+      std::shared_ptr<Task> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_variable_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+        if (stopping_) {
+          return;
+        }
+        task = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      task->Run();
+    }
+  }
+
+  bool stopping_;
+  std::deque<std::shared_ptr<Task>> queue_;
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+  std::vector<std::thread> workers_;
+
+  WorkerPool(const WorkerPool&) = delete;
+  void operator=(const WorkerPool&) = delete;
+};
+
+// The task that runs its `Step()` on the pool after each `Wake()`, never on more than one worker at a time.
+// Wakeups that come while `Step()` is running are not lost: they make the task run once again afterwards.
+// Must be owned by an `std::shared_ptr`, since the pool keeps the task alive while it is scheduled.
+class SerialTask : public Task, public Wakeable, public std::enable_shared_from_this<SerialTask> {
+ public:
+  explicit SerialTask(WorkerPool& pool) : pool_(pool), state_(kIdle) {}
+
+  void Wake() override {
+    int state = state_.load();
+    while (true) {
+      if (state == kIdle) {
+        if (state_.compare_exchange_weak(state, kScheduled)) {
+          pool_.Schedule(shared_from_this());
+          return;
+        }
+      } else if (state == kRunning) {
+        if (state_.compare_exchange_weak(state, kRunningAndWoken)) {
+          return;
+        }
+      } else {
+        return;  // Will run anyway.
+      }
+    }
+  }
+
+ protected:
+  // Returns `true` to be run again right away, after the tasks scheduled so far, to not starve them.
+  // Returns `false` to not be run until the next `Wake()`.
+  virtual bool Step() = 0;
+
+ private:
+  void Run() override {
+    state_ = kRunning;
+    const bool again = Step();
+    int state = kRunning;
+    if (again || !state_.compare_exchange_strong(state, kIdle)) {
+      state_ = kScheduled;
+      pool_.Schedule(shared_from_this());
+    }
+  }
+
+  enum { kIdle, kScheduled, kRunning, kRunningAndWoken };
+
+  WorkerPool& pool_;
+  std::atomic_int state_;
+};
+
+}  // namespace scheduler
+}  // namespace sherlock
+
+#endif  // SHERLOCK_SCHEDULER_POOL_H
@@ -0,0 +1,93 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// The means for concurrent producers to take turns in a fixed order, Disruptor-style.
+//
+// Every producer first claims a ticket, which is a single atomic increment. It is then free to do all
+// the work it can in parallel with the others, and only the final step, taken in its turn, is serialized.
+// The turns are taken in the order of the tickets. The producer waiting for its turn spins, yielding its
+// time slice, since the turns are expected to be short.
+
+#ifndef SHERLOCK_SCHEDULER_SEQUENCER_H
+#define SHERLOCK_SCHEDULER_SEQUENCER_H
+
+#include "../../Bricks/port.h"
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+namespace sherlock {
+namespace scheduler {
+
+class Sequencer final {
+ public:
+  Sequencer() : next_ticket_(0u), turn_(0u) {}
+
+  // Safe to call from any thread.
+  uint64_t Claim() { return next_ticket_.fetch_add(1u, std::memory_order_relaxed); }
+
+  // Runs `f()` once all the tickets preceding `ticket` have taken their turn, and passes the turn on
+  // once it returns or throws. Every claimed ticket must take its turn exactly once, see `Skip()`.
+  template <typename F>
+  auto InTurn(uint64_t ticket, F&& f) -> decltype(f()) {
+    WaitForTurn(ticket);
+    const PassTurnOnExit pass_turn(turn_, ticket);
+    return f();
+  }
+
+  // For the producer that has claimed the ticket, but has nothing to do in its turn, ex. if it has failed.
+  void Skip(uint64_t ticket) {
+    InTurn(ticket, []() {});
+  }
+
+ private:
+  enum { kSpinsBeforeYielding = 64 };
+
+  void WaitForTurn(uint64_t ticket) const {
+    for (size_t spins = 0; turn_.load(std::memory_order_acquire) != ticket; ++spins) {
+      if (spins >= kSpinsBeforeYielding) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  struct PassTurnOnExit final {
+    std::atomic<uint64_t>& turn;
+    const uint64_t ticket;
+    PassTurnOnExit(std::atomic<uint64_t>& turn, uint64_t ticket) : turn(turn), ticket(ticket) {}
+    ~PassTurnOnExit() { turn.store(ticket + 1u, std::memory_order_release); }
+  };
+
+  std::atomic<uint64_t> next_ticket_;
+  std::atomic<uint64_t> turn_;
+
+  Sequencer(const Sequencer&) = delete;
+  void operator=(const Sequencer&) = delete;
+};
+
+}  // namespace scheduler
+}  // namespace sherlock
+
+#endif  // SHERLOCK_SCHEDULER_SEQUENCER_H
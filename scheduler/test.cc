@@ -0,0 +1,147 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+#include "pool.h"
+#include "sequencer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../../Bricks/dflags/dflags.h"
+#include "../../Bricks/3party/gtest/gtest-main-with-dflags.h"
+
+using sherlock::scheduler::Event;
+using sherlock::scheduler::Task;
+using sherlock::scheduler::Sequencer;
+using sherlock::scheduler::SerialTask;
+using sherlock::scheduler::WorkerPool;
+
+TEST(WorkerPool, RunsAllScheduledTasks) {
+  struct CountingTask : Task {
+    std::atomic_size_t& counter;
+    explicit CountingTask(std::atomic_size_t& counter) : counter(counter) {}
+    void Run() override { ++counter; }
+  };
+  std::atomic_size_t counter(0u);
+  WorkerPool pool(4);
+  EXPECT_EQ(4u, pool.Threads());
+  for (int i = 0; i < 1000; ++i) {
+    pool.Schedule(std::make_shared<CountingTask>(counter));
+  }
+  while (counter < 1000u) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(1000u, counter);
+}
+
+TEST(WorkerPool, SerialTaskNeverRunsConcurrentlyAndLosesNoWakeups) {
+  // Each step consumes one unit of work, and asks to be run again while there is more.
+  struct ConsumingTask : SerialTask {
+    std::atomic_size_t produced;
+    std::atomic_size_t consumed;
+    std::atomic_bool running;
+    std::atomic_bool overlapped;
+    explicit ConsumingTask(WorkerPool& pool)
+        : SerialTask(pool), produced(0u), consumed(0u), running(false), overlapped(false) {}
+    bool Step() override {
+      if (running.exchange(true)) {
+        overlapped = true;
+      }
+      if (consumed < produced) {
+        ++consumed;
+      }
+      running = false;
+      return consumed < produced;
+    }
+  };
+
+  WorkerPool pool(4);
+  auto task = std::make_shared<ConsumingTask>(pool);
+  std::vector<std::thread> producers;
+  for (int i = 0; i < 4; ++i) {
+    producers.emplace_back([&task]() {
+      for (int j = 0; j < 10000; ++j) {
+        ++task->produced;
+        task->Wake();
+      }
+    });
+  }
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  while (task->consumed < 40000u) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(40000u, task->consumed);
+  EXPECT_FALSE(task->overlapped);
+}
+
+TEST(Event, WakeupsAreNotLost) {
+  Event event;
+  event.Wake();
+  event.Wait();  // Returns right away, since `Wake()` has been called before.
+
+  std::atomic_bool woken_up(false);
+  std::thread waiter([&event, &woken_up]() {
+    event.Wait();
+    woken_up = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_FALSE(woken_up);
+  event.Wake();
+  waiter.join();
+  EXPECT_TRUE(woken_up);
+}
+
+TEST(Sequencer, TurnsAreTakenInTheOrderOfTickets) {
+  Sequencer sequencer;
+  std::vector<uint64_t> order;  // Only touched in turn, so no locking is needed.
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&sequencer, &order, t]() {
+      for (int i = 0; i < 1000; ++i) {
+        const uint64_t ticket = sequencer.Claim();
+        if ((i + t) % 10 == 0) {
+          sequencer.Skip(ticket);
+        } else {
+          sequencer.InTurn(ticket, [&order, ticket]() { order.push_back(ticket); });
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(3600u, order.size());
+  EXPECT_TRUE(std::is_sorted(order.begin(), order.end()));
+  // The turn is passed on even if it throws.
+  const uint64_t ticket = sequencer.Claim();
+  EXPECT_THROW(sequencer.InTurn(ticket, []() { throw std::logic_error("turn"); }), std::logic_error);
+  EXPECT_EQ(42, sequencer.InTurn(sequencer.Claim(), []() { return 42; }));
+}
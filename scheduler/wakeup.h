@@ -0,0 +1,79 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// The means for the listeners that have caught up with the stream to be woken up once there are new entries,
+// or once they should terminate. Every listener has its own, so that each wakeup is precise: no listener is
+// woken up for nothing, and none has to poll.
+
+#ifndef SHERLOCK_SCHEDULER_WAKEUP_H
+#define SHERLOCK_SCHEDULER_WAKEUP_H
+
+#include "../../Bricks/port.h"
+
+#include <condition_variable>
+#include <mutex>
+
+namespace sherlock {
+namespace scheduler {
+
+class Wakeable {
+ public:
+  virtual ~Wakeable() = default;
+  // Safe to call from any thread, any number of times.
+  virtual void Wake() = 0;
+};
+
+// For the listeners running in their own threads: `Wait()` blocks until `Wake()` has been called
+// since the previous `Wait()` has returned, so that no wakeup is lost.
+class Event final : public Wakeable {
+ public:
+  Event() : signaled_(false) {}
+
+  void Wake() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      signaled_ = true;
+    }
+    condition_variable_.notify_one();
+  }
+
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    condition_variable_.wait(lock, [this]() { return signaled_; });
+    signaled_ = false;
+  }
+
+ private:
+  bool signaled_;
+  std::mutex mutex_;
+  std::condition_variable condition_variable_;
+
+  Event(const Event&) = delete;
+  void operator=(const Event&) = delete;
+};
+
+}  // namespace scheduler
+}  // namespace sherlock
+
+#endif  // SHERLOCK_SCHEDULER_WAKEUP_H
@@ -27,18 +27,33 @@ SOFTWARE.
 
 #include "../Bricks/port.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <map>
 #include <vector>
 #include <string>
 #include <mutex>
 #include <memory>
 #include <thread>
 #include <type_traits>
+#include <typeinfo>
+#include <utility>
 #include <iostream>  // TODO(dkorolev): Remove it from here.
 
 #include "../Bricks/net/api/api.h"
 #include "../Bricks/time/chrono.h"
 #include "../Bricks/template/rmref.h"
-#include "../Bricks/waitable_atomic/waitable_atomic.h"
+
+#include "scheduler/pool.h"
+#include "scheduler/sequencer.h"
+#include "stats/histogram.h"
+#include "storage/arena.h"
+#include "storage/file.h"
+#include "storage/memory.h"
 
 // Sherlock is the overlord of data storage and processing in KnowSheet.
 // Its primary entity is the stream of data.
@@ -55,27 +70,48 @@ SOFTWARE.
 // 2) Name, which is used for local storage and external access, most notably replication and subscriptions.
 //
 // 3) Optional type signature, to prevent data corruption when trying to serialize data using the wrong type.
+//    It is stored in the files of persistent streams, see `Persistence`.
 //
 // New streams are registred as `auto my_stream = sherlock::Stream<MyType>("my_stream");`.
+// Persistent streams are registered as `sherlock::Stream<MyType>("my_stream", sherlock::Persistence(dir));`,
+// and pick up all the entries previously published into them from `dir/my_stream/`. See `storage/file.h`.
+// To keep the memory used flat, only the most recent entries of persistent streams can be kept in memory,
+// see `MemoryPolicy`; the listeners read the older ones from the files.
 //
-// Sherlock runs as a singleton. The stream of a specific name can only be added once.
-// TODO(dkorolev): Implement it this way. :-)
+// Sherlock runs as a singleton. The stream of a specific name can only be added once, see `StreamRegistry`.
+// The streams can be looked up by name via `sherlock::Streams().Find<MyType>("my_stream")`, and shut down
+// via `sherlock::Streams().Shutdown("my_stream")`, which has all their listeners terminate.
 // A user of C++ Sherlock interface should keep the return value of `sherlock::Stream<T>`,
 // as it is later used as the proxy to publish and subscribe to the data from this stream.
 //
 // Sherlock streams can be published into and subscribed to.
-// At any given point of time a stream can have zero or one publisher and any number of listeners.
+// At any given point of time a stream can have any number of listeners, and either zero or one publisher,
+// or, once enabled, any number of concurrent publishers, see below.
 //
 // The publishing is done via `my_stream.Publish(MyType{...});`.
+// Many entries can be published at once via `my_stream.PublishBatch(entries);`: the listeners see either
+// none or all of them, and persistent streams write them out together, with one flush per file.
+//
+//   NOTE: By default, the stream has a single publisher, and it is the caller's responsibility to ensure that:
+//   1) Publishing is done from one thread at a time, as the single publisher takes no locks, and
+//   2) The published entries come in non-decreasing order of their timestamps.
+//
+//   Once `my_stream.EnableConcurrentPublishers();` has been called, before publishing anything, neither is
+//   the caller's responsibility. Any number of threads can publish at once: each claims its turn with one
+//   atomic increment, constructs and serializes its entry in parallel with the others, and adds it
+//   to the stream in its turn. An entry the timestamp of which precedes the one of the entry added before it
+//   is rejected by throwing `InconsistentTimestampException`, for its publisher to retry with a new timestamp.
 //
-//   NOTE: It is the caller's full responsibility to ensure that:
-//   1) Publishing is done from one thread only (since Sherlock offers no locking), and
-//   2) The published entries come in non-decreasing order of their timestamps. TODO(dkorolev): Assert this.
+//   A publisher with nothing to publish at the moment can call `my_stream.UpdateHead(timestamp);` to promise
+//   no entries timestamped before `timestamp` will follow, for the listeners joining sparse streams
+//   to move on without waiting for the next entry. See `HeadUpdated()` below. The promise is kept by Sherlock:
+//   the entries timestamped before the head are rejected by throwing `InconsistentTimestampException`.
 //
 // Subscription is done by via `my_stream.Subscribe(my_listener);`,
 // where `my_listener` is an instance of the class doing the listening.
 //
-//   NOTE: that Sherlock runs each listener in a dedicated thread.
+//   NOTE: Sherlock runs each listener either in a dedicated thread, or on a worker pool, see below. Either way,
+//   the member functions of the listener are never called concurrently, and it sees the entries in order.
 //
 //   The `my_listener` object should expose the following member functions:
 //
@@ -85,14 +121,30 @@ SOFTWARE.
 //      which may end up blocking the thread until new, yet unseen, entries have been published.
 //      Returning `false` will lead to no more entries passed to the listener, and the thread will be
 //      terminated.
+//      If the signature is `Entry(const T_ENTRY& entry, ...)`, the entry stored in the stream is passed as is.
+//      If it is `Entry(T_ENTRY& entry, ...)`, the listener is passed its own copy, which it can `std::move()`
+//      away. The copy is made via the copy constructor or, for `std::unique_ptr<BASE>` entries, via
+//      `BASE::Clone()` if it is defined, falling back to the JSON serialization round-trip otherwise.
+//
+//   1a) `bool EntryBatch(const EntriesRange<T_ENTRY>& entries, size_t first_index, size_t total)`:
+//      Optional. If defined, it is called instead of `Entry()` with all the entries available at the moment,
+//      in the `[first_index, first_index + entries.size())` range. This saves on per-entry wakeups
+//      when replaying the history. Returning `false` has the same meaning as it does for `Entry()`.
+//      The history of persistent streams, which is read from the storage, is passed in chunks.
 //
 //   2) `void CaughtUp()`:
-//      TODO(dkorolev): Implement it.
-//      This method will be called as soon as the "historical data replay" phase is completed,
+//      Optional. This method is called as soon as the "historical data replay" phase is completed,
 //      and the listener has entered the mode of serving the new entires coming in the real time.
 //      This method is designed to flip some external variable or endpoint to the "healthy" state,
-//      when the listener is considered eligible to serve incoming data requests.
-//      TODO(dkorolev): Discuss the case if the listener falls behind again.
+//      when the listener is considered eligible to serve incoming data requests, and to have the listener
+//      skip the per-entry work that is cheaper done in bulk once the history is replayed.
+//      The listener falls behind again once it is more than `StreamData::kMaxCaughtUpLag` entries behind,
+//      and `CaughtUp()` is called again once it catches up. `ListenersStats()` reports the same state.
+//
+//   2a) `void HeadUpdated(EPOCH_MILLISECONDS head)`:
+//      Optional. Called once the listener has been passed all the entries available, if the publisher
+//      has called `UpdateHead(head)` since the last one of them, and `head` is past the one passed last time.
+//      The listener has then seen everything timestamped before `head`, and may emit the results up to it.
 //
 //   3) `void Terminate` or `bool Terminate()`:
 //      This member function will be called if the listener has to be terminated externally,
@@ -104,13 +156,36 @@ SOFTWARE.
 // The call to `my_stream.Subscribe(my_listener);` launches the listener and returns
 // an instance of a handle, the scope of which will define the lifetime of the listener.
 //
+// To start from a certain entry, use `my_stream.Subscribe(my_listener, from_index);`. The entries before
+// `from_index` are not looked at, and, for persistent streams, only the file containing it is read from.
+// The HTTP endpoint supports this via `?from=`; `?n=` without `?recent=` also seeks right to the tail.
+// With `?nowait`, the HTTP endpoint ends the response once it has served the entries available at the moment,
+// instead of waiting for more. This is how the streams are replicated, see `replication/follower.h`.
+// With `?format=binary`, the entries are output in Cereal's binary format instead of JSON, see `BinaryEntry()`.
+//
 // If the subscribing thread would like the listener to run forever, it can
 // use use `.Join()` or `.Detach()` on the handle. `Join()` will block the calling thread unconditionally,
 // until the listener itself decides to stop listening. `Detach()` will ensure
 // that the ownership of the listener object has been transferred to the thread running the listener,
 // and detach this thread to run in the background.
 //
-// TODO(dkorolev): Data persistence and tests.
+// Each listener runs in its own thread by default. To serve many listeners with a few threads,
+// use `my_stream.SyncSubscribe(my_listener, my_pool);` or `my_stream.AsyncSubscribe(..., my_pool);`,
+// where `my_pool` is a `sherlock::scheduler::WorkerPool`, which must outlive the listeners run on it.
+// Pooled listeners that have caught up with the stream cost no thread, and are woken up on new entries.
+// Each pooled listener is run by at most one worker at a time, so it still sees the entries in order, but
+// there is no order among different listeners, and a listener that blocks holds up its worker meanwhile.
+// `my_stream.ServeHTTPSubscribersOn(my_pool);` does the same for the HTTP subscribers of the stream.
+//
+// To listen to many streams of the same type at once, in the order of the order keys of their entries,
+// with one thread for all of them, see `merge/merge.h`.
+//
+// `my_stream.Stats()`, also served via HTTP with `?stats`, tells the rate of publishing, the latencies of
+// publishing and of delivering the entries to the listeners, and how far behind each listener is.
+// `my_stream.ListenersStats()` tells the latter alone. A listener that falls too far behind
+// can be disconnected, skipped ahead to the new entries, or have the publisher wait for it, for a while;
+// see `SlowListenerPolicy`, set via `SetSlowListenerPolicy()` and `SetSlowHTTPSubscriberPolicy()`.
+//
 // TODO(dkorolev): Add timestamps support and tests.
 // TODO(dkorolev): Ensure the timestamps always come in a non-decreasing order.
 
@@ -130,14 +205,156 @@ struct ExtractTimestampImpl<std::unique_ptr<E>> {
 
 template <typename E>
 bricks::time::EPOCH_MILLISECONDS ExtractTimestamp(E&& entry) {
-  return ExtractTimestampImpl<bricks::rmref<E>>::ExtractTimestamp(std::forward<E>(entry));
+  return ExtractTimestampImpl<bricks::rmconstref<E>>::ExtractTimestamp(std::forward<E>(entry));
+}
+
+// The order key of the entry is its timestamp if the type of the entry defines `ExtractTimestamp()`,
+// and its index otherwise.
+template <typename E>
+struct TimestampedEntryType {
+  typedef E type;
+};
+
+template <typename E>
+struct TimestampedEntryType<std::unique_ptr<E>> {
+  typedef E type;
+};
+
+template <typename E>
+constexpr bool HasExtractTimestampMethod(char) {
+  return false;
+}
+
+template <typename E>
+constexpr auto HasExtractTimestampMethod(int)
+    -> decltype(std::declval<const typename TimestampedEntryType<E>::type&>().ExtractTimestamp(), bool()) {
+  return true;
 }
 
+template <typename E, bool HAS_EXTRACT_TIMESTAMP_METHOD>
+struct OrderKeyImpl {
+  static uint64_t DoIt(const E&, size_t index) { return index; }
+};
+
+template <typename E>
+struct OrderKeyImpl<E, true> {
+  static uint64_t DoIt(const E& entry, size_t) { return static_cast<uint64_t>(ExtractTimestamp(entry)); }
+};
+
+template <typename E>
+uint64_t OrderKey(const E& entry, size_t index) {
+  return OrderKeyImpl<E, HasExtractTimestampMethod<E>(0)>::DoIt(entry, index);
+}
+
+// With `?format=binary`, the HTTP endpoint outputs each entry serialized via Cereal's binary archive,
+// prefixed by its length as four little-endian bytes. `BinaryEntriesReader` parses it back on the client side.
+enum { kBinaryEntryLengthSize = 4 };
+
+template <typename E>
+std::string BinaryEntry(const E& entry) {
+  const std::string payload = storage::SerializeEntryToBinary(entry);
+  std::string result;
+  result.reserve(kBinaryEntryLengthSize + payload.length());
+  storage::AppendLittleEndian(result, payload.length(), kBinaryEntryLengthSize);
+  result += payload;
+  return result;
+}
+
+// Accepts the response in chunks of any size, and keeps the incomplete entry until the rest of it comes.
+template <typename E>
+class BinaryEntriesReader final {
+ public:
+  // Calls `f(E&& entry)` for each entry completed by this chunk.
+  template <typename F>
+  void Feed(const char* data, size_t length, F&& f) {
+    if (buffer_.empty()) {
+      // The whole entries are parsed right from the chunk, with no copies made.
+      const size_t parsed = Parse(data, length, std::forward<F>(f));
+      buffer_.assign(data + parsed, length - parsed);
+    } else {
+      buffer_.append(data, length);
+      buffer_.erase(0u, Parse(buffer_.data(), buffer_.length(), std::forward<F>(f)));
+    }
+  }
+
+  template <typename F>
+  void Feed(const std::string& chunk, F&& f) {
+    Feed(chunk.data(), chunk.length(), std::forward<F>(f));
+  }
+
+  // The number of bytes of the incomplete entry fed so far. Zero once the whole response has been parsed.
+  size_t Incomplete() const { return buffer_.length(); }
+
+ private:
+  // Returns the number of bytes parsed.
+  template <typename F>
+  static size_t Parse(const char* data, size_t length, F&& f) {
+    size_t offset = 0u;
+    while (length - offset >= kBinaryEntryLengthSize) {
+      const size_t payload_length = storage::ParseLittleEndian(data + offset, kBinaryEntryLengthSize);
+      if (length - offset - kBinaryEntryLengthSize < payload_length) {
+        break;
+      }
+      E entry;
+      storage::ParseEntryFromBinary(data + offset + kBinaryEntryLengthSize, payload_length, entry);
+      offset += kBinaryEntryLengthSize + payload_length;
+      f(std::move(entry));
+    }
+    return offset;
+  }
+
+  std::string buffer_;
+};
+
+// The entries served to the HTTP subscribers of the stream, encoded once per format for all of them.
+// Only the most recently encoded entries are kept, as the subscribers mostly read the same ones, near the end
+// of the stream. The slots are guarded by striped locks, so that the subscribers rarely wait for one another.
+class EncodedEntriesCache final {
+ public:
+  enum class Format { JSON, Binary };
+  enum { kSlotsPerFormat = 1024, kStripes = 64 };
+
+  EncodedEntriesCache() : slots_(2 * kSlotsPerFormat) {}
+
+  // Returns the entry with this index as encoded by `encode()`, which is only called if it has not been yet.
+  // The entries never change once published, so the index is all it takes to tell them apart.
+  template <typename F>
+  std::shared_ptr<const std::string> Get(Format format, size_t index, F&& encode) {
+    Slot& slot = slots_[static_cast<size_t>(format) * kSlotsPerFormat + index % kSlotsPerFormat];
+    std::mutex& mutex = stripes_[index % kStripes];
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (slot.encoded && slot.index == index) {
+        return slot.encoded;
+      }
+    }
+    // Encoded with no locks held. Rarely, two subscribers encode the same entry at once, and one result stays.
+    auto encoded = std::make_shared<const std::string>(encode());
+    std::lock_guard<std::mutex> lock(mutex);
+    slot.index = index;
+    slot.encoded = encoded;
+    return encoded;
+  }
+
+ private:
+  struct Slot {
+    size_t index = 0u;
+    std::shared_ptr<const std::string> encoded;
+  };
+  std::vector<Slot> slots_;
+  std::mutex stripes_[kStripes];
+};
+
+template <typename T>
+class EntriesRange;
+
 template <typename E>
 class PubSubHTTPEndpoint final {
  public:
-  PubSubHTTPEndpoint(const std::string& value_name, Request r)
+  // If `cache` is set, the entries are encoded once for all the subscribers sharing it.
+  PubSubHTTPEndpoint(const std::string& value_name, Request r, EncodedEntriesCache* cache = nullptr)
       : value_name_(value_name),
+        cache_(cache),
         http_request_(std::move(r)),
         http_response_(http_request_.SendChunkedResponse()) {
     if (http_request_.url.query.has("recent")) {
@@ -159,47 +376,134 @@ class PubSubHTTPEndpoint final {
     if (http_request_.url.query.has("cap")) {
       bricks::strings::FromString(http_request_.url.query["cap"], cap_);
     }
+    if (http_request_.url.query.has("from")) {
+      // `from` is the index of the first entry to consider; the above conditions apply on top of it.
+      bricks::strings::FromString(http_request_.url.query["from"], from_);
+    }
+    if (http_request_.url.query.has("nowait")) {
+      nowait_ = true;
+    }
+    if (http_request_.url.query.has("format") && http_request_.url.query["format"] == "binary") {
+      binary_ = true;
+    }
   }
 
-  bool Entry(E& entry, size_t index, size_t total) {
-    // TODO(dkorolev): Should we always extract the timestamp and throw an exception if there is a mismatch?
-    try {
+  // With `?nowait`, there is nothing to serve if there are no entries from `from_index` on at the moment.
+  bool NothingToServe(size_t from_index, size_t total) const { return nowait_ && from_index >= total; }
+
+  // The index to start the subscription from. The entries that would not be served are skipped right away,
+  // instead of being iterated over: the ones preceding the last `n` directly, and the ones older than `recent`
+  // by looking up the first recent enough entry with `data.LowerBound()`, as the timestamps are non-decreasing.
+  template <typename DATA>
+  size_t FirstIndexToServe(const DATA& data) {
+    const size_t total = data.Size();
+    const size_t last_n = total > n_ ? total - n_ : 0u;
+    if (from_timestamp_ == static_cast<bricks::time::EPOCH_MILLISECONDS>(-1)) {
       if (!serving_) {
-        const bricks::time::EPOCH_MILLISECONDS timestamp = ExtractTimestamp(entry);
-        // Respect `n`.
-        if (total - index <= n_) {
-          serving_ = true;
-        }
-        // Respect `recent`.
-        if (from_timestamp_ != static_cast<bricks::time::EPOCH_MILLISECONDS>(-1) &&
-            timestamp >= from_timestamp_) {
-          serving_ = true;
-        }
+        serving_ = true;
+        return std::max(from_, last_n);
+      } else {
+        return from_;
       }
-      if (serving_) {
-        http_response_(entry, value_name_);
-        if (cap_) {
-          --cap_;
-          if (!cap_) {
-            return false;
-          }
+    } else {
+      // Either condition makes the entry served, thus the earliest of the two is where to start.
+      // The `Serve()` method still checks the timestamps from there on.
+      return std::max(from_, std::min(last_n, data.LowerBound(static_cast<uint64_t>(from_timestamp_))));
+    }
+  }
+
+  // The entries are coalesced into chunks, instead of being sent one by one, which matters when replaying
+  // the history. A chunk is sent once it is `kMaxChunkBytes` large, or `kMaxChunkDelay` old,
+  // and once the subscriber has caught up with the stream, so that the new entries are not delayed.
+  enum { kMaxChunkBytes = 64 * 1024 };
+  static std::chrono::milliseconds MaxChunkDelay() { return std::chrono::milliseconds(5); }
+
+  bool EntryBatch(const EntriesRange<E>& entries, size_t first_index, size_t total) {
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (!Serve(entries[i], first_index + i, total)) {
+        Flush();
+        return false;
+      }
+      const bool chunk_is_due =
+          chunk_.length() >= kMaxChunkBytes ||
+          (!chunk_.empty() && std::chrono::steady_clock::now() - chunk_started_ >= MaxChunkDelay());
+      if (chunk_is_due && !Flush()) {
+        return false;
+      }
+    }
+    // `total` is the size of the stream as of this batch.
+    return first_index + entries.size() < total || Flush();
+  }
+
+  bool Terminate() {
+    if (!binary_) {
+      // The binary output has no room for the error message, and just ends.
+      chunk_ += "{\"error\":\"The subscriber has terminated.\"}\n";
+    }
+    Flush();
+    return true;  // Confirm termination.
+  }
+
+ private:
+  // Adds the entry to the chunk if it should be served. Returns `false` once no more entries should be.
+  bool Serve(const E& entry, size_t index, size_t total) {
+    // TODO(dkorolev): Should we always extract the timestamp and throw an exception if there is a mismatch?
+    if (!serving_) {
+      const bricks::time::EPOCH_MILLISECONDS timestamp = ExtractTimestamp(entry);
+      // Respect `n`.
+      if (total - index <= n_) {
+        serving_ = true;
+      }
+      // Respect `recent`.
+      if (from_timestamp_ != static_cast<bricks::time::EPOCH_MILLISECONDS>(-1) &&
+          timestamp >= from_timestamp_) {
+        serving_ = true;
+      }
+    }
+    if (serving_) {
+      if (chunk_.empty()) {
+        chunk_started_ = std::chrono::steady_clock::now();
+      }
+      if (cache_) {
+        const auto format = binary_ ? EncodedEntriesCache::Format::Binary : EncodedEntriesCache::Format::JSON;
+        chunk_ += *cache_->Get(format, index, [this, &entry]() { return Encode(entry); });
+      } else {
+        chunk_ += Encode(entry);
+      }
+      if (cap_) {
+        --cap_;
+        if (!cap_) {
+          return false;
         }
       }
+    }
+    return !(nowait_ && index + 1 >= total);
+  }
+
+  // Sends the chunk, if there is anything in it. Returns `false` if the subscriber has gone away.
+  bool Flush() {
+    if (chunk_.empty()) {
+      return true;
+    }
+    try {
+      http_response_(chunk_);
+      chunk_.clear();
       return true;
     } catch (const bricks::net::NetworkException&) {
       return false;
     }
   }
 
-  bool Terminate() {
-    http_response_("{\"error\":\"The subscriber has terminated.\"}\n");
-    return true;  // Confirm termination.
+  std::string Encode(const E& entry) const {
+    return binary_ ? BinaryEntry(entry) : JSON(entry, value_name_) + '\n';
   }
 
- private:
   // Top-level JSON object name for Cereal.
   const std::string& value_name_;
 
+  // Null if the entries are encoded by this subscriber alone.
+  EncodedEntriesCache* const cache_;
+
   // `http_request_`:  need to keep the passed in request in scope for the lifetime of the chunked response.
   Request http_request_;
 
@@ -212,8 +516,18 @@ class PubSubHTTPEndpoint final {
   size_t n_ = 0;
   // If set, the hard limit on the maximum number of entries to output.
   size_t cap_ = 0;
+  // If set, the index of the first entry to output.
+  size_t from_ = 0;
   // If set, the timestamp from which the output should start.
   bricks::time::EPOCH_MILLISECONDS from_timestamp_ = static_cast<bricks::time::EPOCH_MILLISECONDS>(-1);
+  // If set, the output ends once the entries available at the moment have been served.
+  bool nowait_ = false;
+  // If set, the entries are output in the binary format, see `BinaryEntry()`.
+  bool binary_ = false;
+
+  // The entries to send as one chunk, and when the first of them was added.
+  std::string chunk_;
+  std::chrono::steady_clock::time_point chunk_started_;
 
   PubSubHTTPEndpoint() = delete;
   PubSubHTTPEndpoint(const PubSubHTTPEndpoint&) = delete;
@@ -265,6 +579,892 @@ bool CallTerminate(T&& ptr) {
           value>::DoIt(ptr);
 }
 
+template <typename T>
+constexpr bool HasCaughtUpMethod(char) {
+  return false;
+}
+
+template <typename T>
+constexpr auto HasCaughtUpMethod(int) -> decltype(std::declval<T>() -> CaughtUp(), bool()) {
+  return true;
+}
+
+template <typename T, bool>
+struct CallCaughtUpImpl {
+  static void DoIt(T&&) {}
+};
+
+template <typename T>
+struct CallCaughtUpImpl<T, true> {
+  static void DoIt(T&& ptr) { ptr->CaughtUp(); }
+};
+
+template <typename T>
+void CallCaughtUp(T&& ptr) {
+  CallCaughtUpImpl<T, HasCaughtUpMethod<T>(0)>::DoIt(std::forward<T>(ptr));
+}
+
+template <typename T>
+constexpr bool HasHeadUpdatedMethod(char) {
+  return false;
+}
+
+template <typename T>
+constexpr auto HasHeadUpdatedMethod(int)
+    -> decltype(std::declval<T>() -> HeadUpdated(std::declval<bricks::time::EPOCH_MILLISECONDS>()), bool()) {
+  return true;
+}
+
+template <typename T, bool>
+struct CallHeadUpdatedImpl {
+  static void DoIt(T&&, bricks::time::EPOCH_MILLISECONDS) {}
+};
+
+template <typename T>
+struct CallHeadUpdatedImpl<T, true> {
+  static void DoIt(T&& ptr, bricks::time::EPOCH_MILLISECONDS head) { ptr->HeadUpdated(head); }
+};
+
+template <typename T>
+void CallHeadUpdated(T&& ptr, bricks::time::EPOCH_MILLISECONDS head) {
+  CallHeadUpdatedImpl<T, HasHeadUpdatedMethod<T>(0)>::DoIt(std::forward<T>(ptr), head);
+}
+
+// Entries are cloned for the listeners that accept them by a non-const reference, to be free to `std::move()`
+// them away. The clone is made via the copy constructor, or, for polymorphic `std::unique_ptr<>` entries,
+// via the `Clone()` method of the base class if it is defined. The JSON round-trip is the last resort.
+template <typename B>
+constexpr bool HasCloneMethod(char) {
+  return false;
+}
+
+template <typename B>
+constexpr auto HasCloneMethod(int) -> decltype(std::declval<const B&>().Clone(), bool()) {
+  return true;
+}
+
+template <typename T>
+T CloneEntryViaJSON(const T& entry) {
+  const std::string json = JSON(entry);
+  T copy_of_entry;
+  try {
+    ParseJSON(json, copy_of_entry);
+  } catch (const std::exception& e) {
+    std::cerr << "Something went terribly wrong." << std::endl;
+    std::cerr << e.what();
+    ::exit(-1);
+  }
+  return copy_of_entry;
+}
+
+template <typename T, bool IS_COPYABLE>
+struct CloneEntryImpl {
+  static T DoIt(const T& entry) { return CloneEntryViaJSON(entry); }
+};
+
+template <typename T>
+struct CloneEntryImpl<T, true> {
+  static T DoIt(const T& entry) { return T(entry); }
+};
+
+template <typename B, bool HAS_CLONE_METHOD>
+struct ClonePolymorphicEntryImpl {
+  static std::unique_ptr<B> DoIt(const std::unique_ptr<B>& entry) { return CloneEntryViaJSON(entry); }
+};
+
+template <typename B>
+struct ClonePolymorphicEntryImpl<B, true> {
+  static std::unique_ptr<B> DoIt(const std::unique_ptr<B>& entry) {
+    return entry ? std::unique_ptr<B>(entry->Clone()) : std::unique_ptr<B>();
+  }
+};
+
+template <typename B>
+struct CloneEntryImpl<std::unique_ptr<B>, false> {
+  static std::unique_ptr<B> DoIt(const std::unique_ptr<B>& entry) {
+    return ClonePolymorphicEntryImpl<B, HasCloneMethod<B>(0)>::DoIt(entry);
+  }
+};
+
+template <typename T>
+T CloneEntry(const T& entry) {
+  return CloneEntryImpl<T, std::is_copy_constructible<T>::value>::DoIt(entry);
+}
+
+// Listeners that accept `const T&` are passed the very entry stored in the stream, with no copy made.
+template <typename F, typename T>
+constexpr bool HasConstEntryMethod(char) {
+  return false;
+}
+
+template <typename F, typename T>
+constexpr auto HasConstEntryMethod(int)
+    -> decltype(std::declval<F>()->Entry(std::declval<const T&>(), 0u, 0u), bool()) {
+  return true;
+}
+
+// The history of the stream: the entries persisted before the stream was started, that are not kept in memory,
+// as well as the ones that have been dropped from memory since, see `MemoryPolicy`.
+// Each listener reads them from the storage on its own, with its own `StreamHistoryReader`.
+template <typename T>
+class StreamHistoryReader {
+ public:
+  virtual ~StreamHistoryReader() = default;
+  // Appends up to `max_entries` entries, starting from `index`, to `output`.
+  virtual void Read(size_t index, size_t max_entries, std::vector<T>& output) = 0;
+  // The reader can read the `[0, Size())` range of indexes, as of the moment it was created.
+  virtual size_t Size() const = 0;
+};
+
+template <typename T>
+class StreamHistory {
+ public:
+  virtual ~StreamHistory() = default;
+  // The history spans the `[0, Size())` range of indexes, which may overlap with the entries in memory.
+  // It only grows, and does so before the entries are dropped from memory.
+  virtual size_t Size() const = 0;
+  virtual std::unique_ptr<StreamHistoryReader<T>> CreateReader() const = 0;
+  // The index of the first entry with the order key not less than `order_key`, or `Size()` if there is none.
+  virtual size_t LowerBound(uint64_t order_key) const = 0;
+};
+
+// What to do with the listener that has fallen behind the stream by more than `max_lag` entries,
+// and has not caught up for `grace` since. The listeners replaying the history are behind too,
+// which `max_lag` should allow for.
+struct SlowListenerPolicy {
+  enum class Action {
+    // Let it be.
+    None,
+    // Have it terminate, as if its scope requested it, with no way to decline. Ends the HTTP responses.
+    Disconnect,
+    // Have it skip the entries it is behind on, and wait for the new ones.
+    SkipToLive,
+    // Have the publisher wait for it to catch up, but for no longer than `max_publisher_wait` per publish.
+    BlockPublisher
+  };
+  Action action = Action::None;
+  size_t max_lag = std::numeric_limits<size_t>::max();
+  std::chrono::milliseconds grace = std::chrono::milliseconds(0);
+  std::chrono::milliseconds max_publisher_wait = std::chrono::milliseconds(100);
+
+  SlowListenerPolicy() = default;
+  SlowListenerPolicy(Action action, size_t max_lag) : action(action), max_lag(max_lag) {}
+};
+
+// How far the listener is, as seen from outside of it.
+struct ListenerStats {
+  // The index of the next entry to pass to the listener.
+  size_t cursor;
+  // The number of entries published that have not been passed to the listener yet.
+  size_t lag;
+  size_t entries_passed;
+  // See `SlowListenerPolicy::Action::SkipToLive`.
+  size_t entries_skipped;
+  // See `CaughtUp()` at the top of `sherlock.h`.
+  bool caught_up;
+  // On average, since the listener has started.
+  double entries_per_second;
+
+  template <typename A>
+  void serialize(A& ar) {
+    ar(cereal::make_nvp("cursor", cursor),
+       cereal::make_nvp("lag", lag),
+       cereal::make_nvp("entries_passed", entries_passed),
+       cereal::make_nvp("entries_skipped", entries_skipped),
+       cereal::make_nvp("caught_up", caught_up),
+       cereal::make_nvp("entries_per_second", entries_per_second));
+  }
+};
+
+// The contents of the stream, shared between its publisher and its listeners.
+//
+// The publisher appends entries to the lock-free log, and the listeners read all committed entries
+// without taking any locks. The listeners that have caught up with the stream register to be woken up,
+// each by its own `scheduler::Wakeable`, and the publisher only takes the mutex if anyone has registered.
+//
+// The entries of persistent streams may be dropped from memory once they are in the history, oldest first.
+// The listeners pin the entries they read from memory, see `Pin`, so that they are not freed meanwhile.
+template <typename T>
+class StreamData final {
+ public:
+  StreamData()
+      : base_(0u),
+        history_size_(0u),
+        waiting_listeners_(0u),
+        shutdown_requested_(false),
+        listeners_blocking_publisher_(0u),
+        publisher_waiting_(0u),
+        last_commit_size_(0u),
+        last_commit_time_(0) {}
+
+  // Must be called before any entries are added, and before any listeners are started.
+  void SetHistory(std::unique_ptr<StreamHistory<T>> history) {
+    assert(!log_.size());
+    history_ = std::move(history);
+    base_ = history_->Size();
+    history_size_ = base_;
+  }
+
+  // The entries below this index are read from the history, and the ones from it on are in memory.
+  // Grows as the entries are dropped from memory.
+  size_t HistorySize() const { return history_size_.load(std::memory_order_seq_cst); }
+  const StreamHistory<T>& History() const {
+    assert(history_);
+    return *history_;
+  }
+
+  size_t Size() const { return base_ + log_.size(); }
+
+  // Safe to call from any thread for the entries in memory that have been pinned,
+  // and from the publisher thread for all the entries in memory, i.e. from `HistorySize()` to `Size()`.
+  const T& operator[](size_t index) const {
+    assert(index >= base_);
+    return log_[index - base_];
+  }
+
+  // Keeps the entries in memory from a certain index on from being freed, as long as they have not been
+  // dropped from memory yet. Each listener has its own, and moves it forward as it reads the entries.
+  class Pin final {
+   public:
+    explicit Pin(const StreamData& data) : data_(data), index_(kUnpinned) { data_.AddPin(this); }
+    ~Pin() { data_.RemovePin(this); }
+
+    // Returns `true` if the entries from `index` on are in memory, and pins them there until the next call.
+    // Returns `false` if they should be read from the history.
+    bool PinIfInMemory(size_t index) {
+      // Pairs with `DropFromMemory()`: either it observes the pin, or the pin observes the entry is dropped.
+      index_.store(index, std::memory_order_seq_cst);
+      if (index >= data_.HistorySize()) {
+        return true;
+      }
+      index_.store(kUnpinned, std::memory_order_relaxed);
+      return false;
+    }
+
+   private:
+    friend class StreamData;
+    enum : size_t { kUnpinned = ~static_cast<size_t>(0) };
+    const StreamData& data_;
+    std::atomic_size_t index_;
+
+    Pin(const Pin&) = delete;
+    void operator=(const Pin&) = delete;
+  };
+
+  // The index of the first entry with the order key not less than `order_key`, or `Size()` if there is none.
+  // Safe to call from any thread. The order keys are non-decreasing, so the entries in memory are binary
+  // searched, and the history is only looked into if the first entry in memory does not precede `order_key`.
+  size_t LowerBound(uint64_t order_key) const {
+    Pin pin(*this);
+    size_t begin = HistorySize();
+    while (!pin.PinIfInMemory(begin)) {
+      begin = HistorySize();
+    }
+    size_t end = Size();
+    if (history_ && (begin == end || OrderKey((*this)[begin], begin) >= order_key)) {
+      return history_->LowerBound(order_key);
+    }
+    while (begin < end) {
+      const size_t middle = begin + (end - begin) / 2;
+      if (OrderKey((*this)[middle], middle) < order_key) {
+        begin = middle + 1;
+      } else {
+        end = middle;
+      }
+    }
+    return begin;
+  }
+
+  // Drops the entries below `index` from memory. The history must contain them already, as from now on
+  // the listeners read them from it. They are freed a block at a time, once no listener has them pinned.
+  // Must only be called from the publisher thread.
+  void DropFromMemory(size_t index) {
+    assert(index <= Size());
+    size_t history_size = history_size_.load(std::memory_order_relaxed);
+    if (index > history_size) {
+      assert(history_ && index <= history_->Size());
+      history_size = index;
+      history_size_.store(index, std::memory_order_seq_cst);
+    }
+    if (((history_size - base_) >> kBlockSizeLog2) <= (log_.released_size() >> kBlockSizeLog2)) {
+      return;  // Not a single more block to free.
+    }
+    size_t release = history_size;
+    {
+      std::lock_guard<std::mutex> lock(pins_mutex_);
+      for (const Pin* pin : pins_) {
+        release = std::min(release, pin->index_.load(std::memory_order_seq_cst));
+      }
+    }
+    if (release > base_) {
+      log_.release_front(release - base_);
+    }
+  }
+
+  // Must only be called from the publisher thread. Returns the index of the added entry.
+  template <typename... ARGS>
+  size_t Emplace(ARGS&&... args) {
+    return EmplaceAndCommit([](const T&, size_t) {}, std::forward<ARGS>(args)...);
+  }
+
+  // Same as `Emplace()`, but calls `before_commit(entry, index)` once the entry has been constructed,
+  // and before it becomes visible to the listeners. If `before_commit()` throws, the entry is discarded.
+  template <typename F, typename... ARGS>
+  size_t EmplaceAndCommit(F&& before_commit, ARGS&&... args) {
+    const size_t index = Size();
+    const T& entry = log_.stage_back(std::forward<ARGS>(args)...);
+    try {
+      before_commit(entry, index);
+    } catch (...) {
+      log_.discard_staged();
+      throw;
+    }
+    Commit();
+    return index;
+  }
+
+  // The entries staged by `AppendAndCommit()`, for `before_commit()` to look at.
+  class StagedEntries final {
+   public:
+    explicit StagedEntries(const storage::InMemoryLog<T>& log) : log_(log) {}
+    size_t size() const { return log_.staged_size(); }
+    const T& operator[](size_t i) const { return log_.staged(i); }
+
+   private:
+    const storage::InMemoryLog<T>& log_;
+  };
+
+  // Appends the entries from `[begin, end)`, that become visible to the listeners all at once, with one wakeup.
+  // Calls `before_commit(staged_entries, first_index)` before that, and discards all the entries if it throws.
+  // Returns the index of the first entry. Must only be called from the publisher thread.
+  template <typename F, typename ITERATOR>
+  size_t AppendAndCommit(F&& before_commit, ITERATOR begin, ITERATOR end) {
+    const size_t first_index = Size();
+    try {
+      for (ITERATOR it = begin; it != end; ++it) {
+        log_.stage_back(*it);
+      }
+      if (log_.staged_size()) {
+        before_commit(StagedEntries(log_), first_index);
+      }
+    } catch (...) {
+      log_.discard_staged();
+      throw;
+    }
+    if (log_.staged_size()) {
+      Commit();
+    }
+    return first_index;
+  }
+
+  // Makes the staged entries visible to the listeners, and wakes up the ones waiting for them.
+  void Commit() {
+    log_.commit_staged();
+    RecordCommitTime();
+    // The fence pairs with the one in `WakeUpWhenAvailable()`: either the publisher observes the waiting
+    // listener and wakes it up, or the listener observes the new entry before going to sleep.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting_listeners_.load(std::memory_order_relaxed)) {
+      Notify();
+    }
+  }
+
+  // Wakes up all the listeners registered to be woken up, once each.
+  void Notify() {
+    std::vector<std::shared_ptr<scheduler::Wakeable>> waiting;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      waiting.swap(waiting_);
+      waiting_listeners_ -= waiting.size();
+    }
+    for (const auto& listener : waiting) {
+      listener->Wake();
+    }
+  }
+
+  // Wakes up `listener` once the log contains more than `cursor` entries, right away if it does already.
+  // With `or_on_shutdown`, also wakes it up once the stream is being shut down, see `Shutdown()`.
+  // With `or_on_head_past`, also wakes it up once `HeadPast(cursor, or_on_head_past)` is non-zero.
+  // Does not block. The registration is dropped once the listener is woken up by the stream;
+  // the listener may also be woken up by others in the meantime, see `ListenerThread`.
+  void WakeUpWhenAvailable(size_t cursor,
+                           std::shared_ptr<scheduler::Wakeable> listener,
+                           bool or_on_shutdown = false,
+                           uint64_t or_on_head_past = kNoHead) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++waiting_listeners_;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (Size() <= cursor && !(or_on_shutdown && shutdown_requested_) &&
+          !HeadPastLocked(cursor, or_on_head_past)) {
+        waiting_.push_back(std::move(listener));
+        return;
+      }
+      --waiting_listeners_;
+    }
+    listener->Wake();
+  }
+
+  // Blocks until the log contains more than `cursor` entries, or until `event` is woken up by someone else.
+  void WaitFor(size_t cursor,
+               const std::shared_ptr<scheduler::Event>& event,
+               bool or_on_shutdown = false,
+               uint64_t or_on_head_past = kNoHead) {
+    WakeUpWhenAvailable(cursor, event, or_on_shutdown, or_on_head_past);
+    event->Wait();
+  }
+
+  // The head is the order key the stream is known to be complete up to, with no entries published since.
+  // It lets the listeners of sparse streams know the time has moved on. Zero is no head, and `kNoHead`
+  // is passed by the listeners that do not care about it.
+  enum : uint64_t { kNoHead = ~static_cast<uint64_t>(0) };
+
+  // Must only be called from the publisher thread. Wakes up the listeners waiting for the head to move on.
+  void UpdateHead(uint64_t order_key) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      head_ = order_key;
+      head_size_ = Size();
+    }
+    // Pairs with the fence in `WakeUpWhenAvailable()`, same as the one in `Commit()`.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting_listeners_.load(std::memory_order_relaxed)) {
+      Notify();
+    }
+  }
+
+  // The head, if it has been updated after the entry before `cursor` was published, and is past `seen`.
+  // Zero otherwise, which is always the case for `seen` of `kNoHead`.
+  uint64_t HeadPast(size_t cursor, uint64_t seen) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return HeadPastLocked(cursor, seen);
+  }
+
+  // Kept by each listener, for the stream to know how far behind it is. See `SlowListenerPolicy`.
+  class ListenerProgress final {
+   public:
+    ListenerProgress(size_t from_index, const SlowListenerPolicy& policy)
+        : policy_(policy),
+          cursor_(from_index),
+          passed_(0u),
+          skipped_(0u),
+          started_(std::chrono::steady_clock::now()),
+          caught_up_(false),
+          lagging_(false) {}
+
+   private:
+    friend class StreamData;
+    const SlowListenerPolicy policy_;
+    std::atomic_size_t cursor_;
+    std::atomic_size_t passed_;
+    std::atomic_size_t skipped_;
+    const std::chrono::steady_clock::time_point started_;
+    std::atomic_bool caught_up_;
+    // Only used by the listener itself.
+    uint64_t head_passed_ = 0u;
+    bool lagging_;
+    std::chrono::steady_clock::time_point lagging_since_;
+
+    ListenerProgress(const ListenerProgress&) = delete;
+    void operator=(const ListenerProgress&) = delete;
+  };
+
+  // The listeners are registered, so that the stream can wait for all of them to be done before it is gone.
+  // A listener is done once it no longer looks at the stream, which includes its `HistoryReplay`.
+  void ListenerStarted(ListenerProgress& progress) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    listeners_.push_back(&progress);
+    if (progress.policy_.action == SlowListenerPolicy::Action::BlockPublisher) {
+      ++listeners_blocking_publisher_;
+    }
+  }
+
+  void ListenerDone(ListenerProgress& progress) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    listeners_.erase(std::find(listeners_.begin(), listeners_.end(), &progress));
+    if (progress.policy_.action == SlowListenerPolicy::Action::BlockPublisher) {
+      --listeners_blocking_publisher_;
+    }
+    progress_.notify_all();
+    if (listeners_.empty()) {
+      no_listeners_.notify_all();
+    }
+  }
+
+  // The listener is behind until it has been passed all the entries available, and falls behind again
+  // once it is more than `kMaxCaughtUpLag` entries behind. See `CaughtUp()` at the top of this file.
+  enum { kMaxCaughtUpLag = 1000 };
+
+  // Called by the listener before it is passed the entries from `cursor` on.
+  void ListenerMayHaveFallenBehind(ListenerProgress& progress, size_t cursor) const {
+    if (IsBehind(cursor, kMaxCaughtUpLag)) {
+      progress.caught_up_.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  // Called by the listener once it has been passed all the entries available, to tell if the head it should
+  // be passed is past the one it has been passed last. Returns zero if it is not. See `HeadPast()`.
+  uint64_t ListenerHeadPast(ListenerProgress& progress, size_t cursor) const {
+    const uint64_t head = HeadPast(cursor, progress.head_passed_);
+    if (head) {
+      progress.head_passed_ = head;
+    }
+    return head;
+  }
+
+  static uint64_t HeadPassed(const ListenerProgress& progress) { return progress.head_passed_; }
+
+  // Called by the listener once it has been passed all the entries available. Returns `true` if it was behind.
+  bool ListenerCaughtUp(ListenerProgress& progress) const {
+    return !progress.caught_up_.exchange(true, std::memory_order_relaxed);
+  }
+
+  // Called by the listener before it is passed the entries from `cursor` on. Returns what should be done
+  // with it if it is slow, and `Action::None` otherwise. The publisher takes care of blocking itself.
+  SlowListenerPolicy::Action SlowListenerAction(ListenerProgress& progress, size_t cursor) const {
+    const SlowListenerPolicy& policy = progress.policy_;
+    if (policy.action == SlowListenerPolicy::Action::None ||
+        policy.action == SlowListenerPolicy::Action::BlockPublisher) {
+      return SlowListenerPolicy::Action::None;
+    }
+    if (!IsBehind(cursor, policy.max_lag)) {
+      progress.lagging_ = false;
+      return SlowListenerPolicy::Action::None;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (!progress.lagging_) {
+      progress.lagging_ = true;
+      progress.lagging_since_ = now;
+    }
+    return now - progress.lagging_since_ >= policy.grace ? policy.action : SlowListenerPolicy::Action::None;
+  }
+
+  // Called by the listener once the entries before `cursor` have been passed to it, or skipped.
+  void ListenerProgressed(ListenerProgress& progress, size_t cursor, bool skipped) {
+    const size_t delta = cursor - progress.cursor_.load(std::memory_order_relaxed);
+    (skipped ? progress.skipped_ : progress.passed_).fetch_add(delta, std::memory_order_relaxed);
+    // Pairs with `WaitForListenersBlockingPublisher()`: either the publisher observes the new cursor,
+    // or the listener observes the publisher waiting, and wakes it up once it does wait.
+    progress.cursor_.store(cursor, std::memory_order_seq_cst);
+    if (publisher_waiting_.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      progress_.notify_all();
+    }
+    if (!skipped) {
+      RecordDeliveryLatency(cursor);
+    }
+  }
+
+  // From the entries being made visible to the listeners to them being passed to the listeners.
+  // Only the listeners that have caught up are accounted for, once per the entries passed at once.
+  const stats::LatencyHistogram& DeliveryLatency() const { return delivery_latency_; }
+
+  // Called by the publisher before adding entries. Waits for the listeners that should block the publisher,
+  // and are behind by more than their `max_lag`, to catch up, for no longer than their `max_publisher_wait`.
+  void WaitForListenersBlockingPublisher() {
+    if (!listeners_blocking_publisher_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++publisher_waiting_;
+    while (!shutdown_requested_) {
+      auto deadline = start;
+      for (const ListenerProgress* progress : listeners_) {
+        const SlowListenerPolicy& policy = progress->policy_;
+        if (policy.action == SlowListenerPolicy::Action::BlockPublisher &&
+            IsBehind(progress->cursor_.load(std::memory_order_seq_cst), policy.max_lag)) {
+          deadline = std::max(deadline, start + policy.max_publisher_wait);
+        }
+      }
+      if (std::chrono::steady_clock::now() >= deadline) {
+        break;
+      }
+      progress_.wait_until(lock, deadline);
+    }
+    --publisher_waiting_;
+  }
+
+  std::vector<ListenerStats> ListenersStats() const {
+    std::vector<ListenerStats> result;
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const ListenerProgress* progress : listeners_) {
+      ListenerStats stats;
+      stats.cursor = progress->cursor_;
+      const size_t size = Size();
+      stats.lag = size > stats.cursor ? size - stats.cursor : 0u;
+      stats.entries_passed = progress->passed_;
+      stats.entries_skipped = progress->skipped_;
+      stats.caught_up = progress->caught_up_;
+      const double seconds = std::chrono::duration<double>(now - progress->started_).count();
+      stats.entries_per_second = seconds > 0 ? stats.entries_passed / seconds : 0.0;
+      result.push_back(stats);
+    }
+    return result;
+  }
+
+  // Once set, the listeners treat it the same way as the request to terminate from their own scope.
+  bool ShutdownRequested() const { return shutdown_requested_; }
+
+  // Has all the listeners terminate, and waits until they are done. The listeners are told to terminate
+  // via `Terminate()`, and the ones that decline it are waited for until they stop on their own.
+  // Thus, must not be called from a listener of this stream, or from the thread that owns its scope.
+  void Shutdown() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutdown_requested_ = true;
+      progress_.notify_all();
+    }
+    Notify();
+    std::unique_lock<std::mutex> lock(mutex_);
+    no_listeners_.wait(lock, [this]() { return listeners_.empty(); });
+  }
+
+ private:
+  bool IsBehind(size_t cursor, size_t max_lag) const {
+    const size_t size = Size();
+    return size > cursor && size - cursor > max_lag;
+  }
+
+  uint64_t HeadPastLocked(size_t cursor, uint64_t seen) const {
+    return seen != kNoHead && head_size_ == cursor && head_ > seen ? head_ : 0u;
+  }
+
+  void AddPin(const Pin* pin) const {
+    std::lock_guard<std::mutex> lock(pins_mutex_);
+    pins_.push_back(pin);
+  }
+
+  void RemovePin(const Pin* pin) const {
+    std::lock_guard<std::mutex> lock(pins_mutex_);
+    pins_.erase(std::find(pins_.begin(), pins_.end(), pin));
+  }
+
+  // The time of the last commit, along with the size of the stream it has made visible, which is set to zero
+  // while the time is being updated, for the listeners to tell if they have read the time of that commit.
+  void RecordCommitTime() {
+    last_commit_size_.store(0u, std::memory_order_seq_cst);
+    last_commit_time_.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                            std::memory_order_seq_cst);
+    last_commit_size_.store(Size(), std::memory_order_seq_cst);
+  }
+
+  // Only the listener that has been passed all the entries of the last commit knows when they were committed.
+  void RecordDeliveryLatency(size_t cursor) {
+    if (last_commit_size_.load(std::memory_order_seq_cst) != cursor) {
+      return;
+    }
+    const std::chrono::steady_clock::duration committed(last_commit_time_.load(std::memory_order_seq_cst));
+    if (last_commit_size_.load(std::memory_order_seq_cst) != cursor) {
+      return;
+    }
+    delivery_latency_.Add(std::chrono::steady_clock::now().time_since_epoch() - committed);
+  }
+
+  enum { kBlockSizeLog2 = 12 };
+
+  std::unique_ptr<StreamHistory<T>> history_;
+  // The index of the first entry of `log_`.
+  size_t base_;
+  std::atomic_size_t history_size_;
+  storage::InMemoryLog<T, kBlockSizeLog2> log_;
+  mutable std::mutex pins_mutex_;
+  mutable std::vector<const Pin*> pins_;
+  std::atomic_size_t waiting_listeners_;
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<scheduler::Wakeable>> waiting_;
+  // Set under `mutex_`, so that no listener registers to be woken up after it has been set and notified.
+  std::atomic_bool shutdown_requested_;
+  std::vector<const ListenerProgress*> listeners_;
+  std::condition_variable no_listeners_;
+  std::atomic_size_t listeners_blocking_publisher_;
+  std::atomic_size_t publisher_waiting_;
+  // Notified as the listeners progress, if the publisher is waiting for them.
+  std::condition_variable progress_;
+  // Set under `mutex_`, see `UpdateHead()`.
+  uint64_t head_ = 0u;
+  size_t head_size_ = 0u;
+  std::atomic_size_t last_commit_size_;
+  std::atomic<std::chrono::steady_clock::rep> last_commit_time_;
+  stats::LatencyHistogram delivery_latency_;
+
+  StreamData(const StreamData&) = delete;
+  StreamData(StreamData&&) = delete;
+  void operator=(const StreamData&) = delete;
+  void operator=(StreamData&&) = delete;
+};
+
+// Passes the entry to the listener. Returns `false` if the listener has requested to stop.
+// The entries stored in memory are shared by all the listeners, and are cloned for the ones that need a copy.
+// The entries read from the history are owned by the listener thread already.
+template <typename T, typename F, bool PASS_CONST_REFERENCE>
+struct PassEntryToListenerImpl {
+  static bool PassStored(F& listener, const T& entry, size_t index, size_t total) {
+    T copy_of_entry = CloneEntry(entry);
+    // TODO(dkorolev): Perhaps RTTI dispatching here.
+    return listener->Entry(copy_of_entry, index, total);
+  }
+  static bool PassOwned(F& listener, T& entry, size_t index, size_t total) {
+    return listener->Entry(entry, index, total);
+  }
+};
+
+template <typename T, typename F>
+struct PassEntryToListenerImpl<T, F, true> {
+  static bool PassStored(F& listener, const T& entry, size_t index, size_t total) {
+    return listener->Entry(entry, index, total);
+  }
+  static bool PassOwned(F& listener, const T& entry, size_t index, size_t total) {
+    return listener->Entry(entry, index, total);
+  }
+};
+
+// No locks are taken: the entry, once committed, is immutable and never moves.
+template <typename T, typename F>
+bool PassEntryToListener(const StreamData<T>& data, F& listener, size_t index) {
+  const size_t total = data.Size();
+  return PassEntryToListenerImpl<T, F, HasConstEntryMethod<F, T>(0)>::PassStored(
+      listener, data[index], index, total);
+}
+
+// A batch of consecutive entries of the stream, passed to the listeners that define `EntryBatch()`.
+// Random-access and iterable, it refers to entries that stay where they are, so no entries are copied.
+template <typename T>
+class EntriesRange final {
+ public:
+  // `SOURCE` is any container with `operator[](size_t)`, where `[begin, end)` are the positions to expose.
+  template <typename SOURCE>
+  EntriesRange(const SOURCE& source, size_t begin, size_t end)
+      : source_(&source), get_(&Get<SOURCE>), begin_(begin), end_(end) {
+    assert(begin <= end);
+  }
+
+  class Iterator final {
+   public:
+    Iterator(const EntriesRange& range, size_t position) : range_(range), position_(position) {}
+    const T& operator*() const { return range_.get_(range_.source_, position_); }
+    const T* operator->() const { return &operator*(); }
+    void operator++() { ++position_; }
+    bool operator==(const Iterator& rhs) const { return position_ == rhs.position_; }
+    bool operator!=(const Iterator& rhs) const { return !operator==(rhs); }
+
+   private:
+    const EntriesRange& range_;
+    size_t position_;
+  };
+
+  size_t size() const { return end_ - begin_; }
+  bool empty() const { return end_ == begin_; }
+  const T& operator[](size_t i) const {
+    assert(i < size());
+    return get_(source_, begin_ + i);
+  }
+  Iterator begin() const { return Iterator(*this, begin_); }
+  Iterator end() const { return Iterator(*this, end_); }
+
+ private:
+  template <typename SOURCE>
+  static const T& Get(const void* source, size_t position) {
+    return (*static_cast<const SOURCE*>(source))[position];
+  }
+
+  const void* source_;
+  const T& (*get_)(const void*, size_t);
+  const size_t begin_;
+  const size_t end_;
+};
+
+// Listeners that define `bool EntryBatch(const EntriesRange<T>& entries, size_t first_index, size_t total)`
+// are passed all the entries available at once, instead of one `Entry()` call per entry.
+template <typename F, typename T>
+constexpr bool HasEntryBatchMethod(char) {
+  return false;
+}
+
+template <typename F, typename T>
+constexpr auto HasEntryBatchMethod(int)
+    -> decltype(std::declval<F>()->EntryBatch(std::declval<const EntriesRange<T>&>(), 0u, 0u), bool()) {
+  return true;
+}
+
+// The state of one listener replaying the history of the stream: the chunk of entries read from the storage,
+// and the pin on the entries in memory, once the listener gets to them.
+template <typename T>
+class HistoryReplay final {
+ public:
+  enum { kChunkSize = 1024 };
+
+  explicit HistoryReplay(const StreamData<T>& data) : data_(data), pin_(data), begin_(0u) {}
+
+  // Returns `true` if the entry at `index` should be read via `Chunk()`. Otherwise, the entries from `index`
+  // on are in memory, and are kept there until the next call.
+  bool InHistory(size_t index) { return !pin_.PinIfInMemory(index); }
+
+  // Returns the chunk of entries that contains the one at `index`, which must be below `HistorySize()`.
+  // The first entry of the chunk is the one at `Begin()`. Consecutive chunks are read sequentially.
+  std::vector<T>& Chunk(size_t index) {
+    assert(index < data_.HistorySize());
+    if (index < begin_ || index >= begin_ + chunk_.size()) {
+      if (!reader_ || index >= reader_->Size()) {
+        // The history has grown since the reader was created.
+        reader_ = data_.History().CreateReader();
+      }
+      chunk_.clear();
+      begin_ = index;
+      reader_->Read(index, std::min(static_cast<size_t>(kChunkSize), reader_->Size() - index), chunk_);
+    }
+    return chunk_;
+  }
+
+  size_t Begin() const { return begin_; }
+
+ private:
+  const StreamData<T>& data_;
+  typename StreamData<T>::Pin pin_;
+  std::unique_ptr<StreamHistoryReader<T>> reader_;
+  std::vector<T> chunk_;
+  size_t begin_;
+};
+
+// Passes the available entries starting from `cursor` to the listener, and advances the `cursor`.
+// Returns `false` if the listener has requested to stop.
+template <typename T, typename F, bool HAS_ENTRY_BATCH_METHOD>
+struct PassEntriesToListenerImpl {
+  static bool DoIt(const StreamData<T>& data, F& listener, size_t& cursor, HistoryReplay<T>& history) {
+    const size_t index = cursor++;
+    if (history.InHistory(index)) {
+      std::vector<T>& chunk = history.Chunk(index);
+      return PassEntryToListenerImpl<T, F, HasConstEntryMethod<F, T>(0)>::PassOwned(
+          listener, chunk[index - history.Begin()], index, data.Size());
+    } else {
+      return PassEntryToListener(data, listener, index);
+    }
+  }
+};
+
+template <typename T, typename F>
+struct PassEntriesToListenerImpl<T, F, true> {
+  static bool DoIt(const StreamData<T>& data, F& listener, size_t& cursor, HistoryReplay<T>& history) {
+    const size_t first_index = cursor;
+    const size_t total = data.Size();
+    if (history.InHistory(first_index)) {
+      const std::vector<T>& chunk = history.Chunk(first_index);
+      cursor = history.Begin() + chunk.size();
+      return listener->EntryBatch(
+          EntriesRange<T>(chunk, first_index - history.Begin(), chunk.size()), first_index, total);
+    } else {
+      cursor = total;
+      return listener->EntryBatch(EntriesRange<T>(data, first_index, total), first_index, total);
+    }
+  }
+};
+
+template <typename T, typename F>
+bool PassEntriesToListener(const StreamData<T>& data, F& listener, size_t& cursor, HistoryReplay<T>& history) {
+  return PassEntriesToListenerImpl<T, F, HasEntryBatchMethod<F, T>(0)>::DoIt(data, listener, cursor, history);
+}
+
 // TODO(dkorolev): Move this to Bricks. Cerealize uses it too, for `WithBaseType`.
 template <typename T>
 struct PretendingToBeUniquePtr {
@@ -286,38 +1486,425 @@ struct PretendingToBeUniquePtr {
   }
 };
 
+// How many of the most recent entries of a persistent stream to keep in memory. By default, all of them.
+//
+// The entries in finalized files are dropped from memory a file at a time, oldest first, as long as the entries
+// left in memory exceed any of the limits. The listeners read them from the files, and switch over to
+// the entries in memory once they get to them. The active file is always kept in memory, so, to bound
+// the memory used, the `FileLogPolicy` of the stream should keep the files small enough as well.
+struct MemoryPolicy {
+  uint64_t max_entries = std::numeric_limits<uint64_t>::max();
+  // Measured as serialized, i.e. by the sizes of the files.
+  uint64_t max_bytes = std::numeric_limits<uint64_t>::max();
+  // Only applies when the entries have timestamps: how far, in milliseconds, the last entry of a file
+  // may precede the last entry of the stream.
+  uint64_t max_age = std::numeric_limits<uint64_t>::max();
+
+  bool Unlimited() const {
+    const uint64_t unlimited = std::numeric_limits<uint64_t>::max();
+    return max_entries == unlimited && max_bytes == unlimited && max_age == unlimited;
+  }
+};
+
+// Makes the stream persistent: its entries are stored in the `<directory>/<stream name>` directory,
+// which is created if it does not exist. See `storage/file.h` for the details.
+//
+// The type signature is stored in every file of the stream, to prevent data corruption when trying
+// to deserialize the entries using the wrong type. It defaults to the name of the type of the entries
+// as provided by the compiler, which is stable for the same type, compiler and platform.
+//
+// Set `memory` to bound how many of the entries are kept in memory, see `MemoryPolicy`.
+struct Persistence {
+  std::string directory;
+  storage::FileLogPolicy policy;
+  std::string type_signature;
+  MemoryPolicy memory;
+  explicit Persistence(const std::string& directory,
+                       const storage::FileLogPolicy& policy = storage::FileLogPolicy(),
+                       const std::string& type_signature = "")
+      : directory(directory), policy(policy), type_signature(type_signature) {}
+};
+
+// Thrown to the concurrent publisher of an entry the timestamp of which precedes the one of the last entry,
+// and to any publisher of an entry the timestamp of which precedes the head, see `UpdateHead()`.
+struct InconsistentTimestampException : bricks::Exception {
+  InconsistentTimestampException(uint64_t last, uint64_t attempted)
+      : bricks::Exception("Publishing an entry timestamped " + std::to_string(attempted) +
+                          " after the one timestamped " + std::to_string(last) + ".") {}
+};
+
+// Thrown by `StreamRegistry`, see below.
+struct StreamAlreadyExistsException : bricks::Exception {
+  explicit StreamAlreadyExistsException(const std::string& name)
+      : bricks::Exception("Stream '" + name + "' already exists.") {}
+};
+
+struct StreamNotFoundException : bricks::Exception {
+  explicit StreamNotFoundException(const std::string& name)
+      : bricks::Exception("Stream '" + name + "' does not exist.") {}
+};
+
+struct StreamTypeMismatchException : bricks::Exception {
+  explicit StreamTypeMismatchException(const std::string& name)
+      : bricks::Exception("Stream '" + name + "' is of a different type.") {}
+};
+
+// Thrown when creating a persistent stream the name of which can not be used as its directory name.
+struct InvalidStreamNameException : bricks::Exception {
+  explicit InvalidStreamNameException(const std::string& name)
+      : bricks::Exception("Stream name '" + name + "' can not be used as a directory name.") {}
+};
+
+// The directory of a persistent stream is named after it, and must be right in `Persistence::directory`.
+inline const std::string& StreamDirectoryName(const std::string& name) {
+  if (name.empty() || name == "." || name == ".." || name.find_first_of("/\\") != std::string::npos) {
+    throw InvalidStreamNameException(name);
+  }
+  return name;
+}
+
+// Thrown to the publisher of an entry into the stream that has been shut down.
+struct StreamIsShutDownException : bricks::Exception {
+  explicit StreamIsShutDownException(const std::string& name)
+      : bricks::Exception("Stream '" + name + "' has been shut down.") {}
+};
+
+// The persistence layer of the stream. Type-erased, so that the entries of in-memory streams
+// do not have to be serializable.
 template <typename T>
-class StreamInstanceImpl {
+class StreamPersister {
  public:
-  explicit StreamInstanceImpl(const std::string& name, const std::string& value_name)
-      : name_(name), value_name_(value_name) {
-    // TODO(dkorolev): Register this stream under this name.
-    // TODO(dk+mz): Ensure the stream lives forever.
+  virtual ~StreamPersister() = default;
+  // Called for every new entry, before it becomes visible to the listeners.
+  virtual void Persist(const T& entry, size_t index) = 0;
+  // Called for the entries published together, before they become visible to the listeners.
+  virtual void PersistBatch(const EntriesRange<T>& entries, size_t first_index) = 0;
+  // The two halves of `Persist()`, for the concurrent publishers to serialize their entries in parallel.
+  // `Serialize()` is safe to call from any thread, `PersistSerialized()` is called in the publisher's turn.
+  virtual std::string Serialize(const T& entry) const = 0;
+  virtual void PersistSerialized(const T& entry, const std::string& serialized_entry, size_t index) = 0;
+  // Called after the entries have been made visible to the listeners: the entries below the returned index
+  // should no longer be kept in memory, and the history contains them already. See `MemoryPolicy`.
+  virtual size_t FirstIndexToKeepInMemory() = 0;
+  // The bytes written since the stream was started. Must only be called from the publisher thread.
+  virtual uint64_t BytesPersisted() const = 0;
+  // The order key of the last entry persisted, zero if there are none.
+  virtual uint64_t LastOrderKey() const = 0;
+};
+
+// The history of a persistent stream: its finalized files. The ones finalized after the stream was started
+// are added to it before their entries are dropped from memory, see `MemoryPolicy`.
+// The listeners replay them right from the files mapped into memory, see `storage::FinalizedFilesReader`.
+template <typename T>
+class FileStreamHistory final : public StreamHistory<T> {
+ public:
+  explicit FileStreamHistory(const storage::FileLog<T>& file_log)
+      : directory_(file_log.Directory()),
+        type_signature_(file_log.TypeSignature()),
+        segments_(std::make_shared<const std::vector<storage::FileLogSegment>>(file_log.FinalizedSegments())) {}
+
+  size_t Size() const override {
+    const auto segments = Segments();
+    return segments->empty() ? 0u : segments->back().last_index + 1;
   }
 
-  // `Publish()` and `Emplace()` return the index of the added entry.
-  size_t Publish(const T& entry) {
-    auto accesor = data_.MutableScopedAccessor();
-    const size_t index = accesor->size();
-    accesor->emplace_back(entry);
-    return index;
+  std::unique_ptr<StreamHistoryReader<T>> CreateReader() const override {
+    return make_unique<Reader>(directory_, *Segments(), type_signature_);
   }
 
-  size_t Publish(T&& entry) {
-    auto accesor = data_.MutableScopedAccessor();
-    const size_t index = accesor->size();
-    accesor->emplace_back(std::move(entry));
-    return index;
+  size_t LowerBound(uint64_t order_key) const override {
+    return storage::FinalizedFilesReader<T>(directory_, *Segments(), type_signature_).LowerBound(order_key);
+  }
+
+  // Must only be called from the publisher thread.
+  void Update(const std::vector<storage::FileLogSegment>& segments) {
+    auto updated = std::make_shared<const std::vector<storage::FileLogSegment>>(segments);
+    std::lock_guard<std::mutex> lock(mutex_);
+    segments_ = std::move(updated);
+  }
+
+ private:
+  struct Reader final : StreamHistoryReader<T> {
+    storage::FinalizedFilesReader<T> reader;
+    Reader(const std::string& directory,
+           const std::vector<storage::FileLogSegment>& segments,
+           const std::string& type_signature)
+        : reader(directory, segments, type_signature) {}
+    void Read(size_t index, size_t max_entries, std::vector<T>& output) override {
+      reader.Read(index, max_entries, output);
+    }
+    size_t Size() const override { return reader.Size(); }
+  };
+
+  std::shared_ptr<const std::vector<storage::FileLogSegment>> Segments() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return segments_;
+  }
+
+  const std::string directory_;
+  const std::string type_signature_;
+  mutable std::mutex mutex_;
+  std::shared_ptr<const std::vector<storage::FileLogSegment>> segments_;
+};
+
+template <typename T>
+class FileStreamPersister final : public StreamPersister<T> {
+ public:
+  // Only the entries of the active file are loaded into memory. The ones from the finalized files
+  // become the history of the stream, and are only read by the listeners that need them.
+  FileStreamPersister(const std::string& directory, const Persistence& persistence, StreamData<T>& data)
+      : file_log_(directory,
+                  persistence.policy,
+                  persistence.type_signature.empty() ? typeid(T).name() : persistence.type_signature,
+                  HasExtractTimestampMethod<T>(0)),
+        memory_(persistence.memory),
+        segments_seen_(file_log_.FinalizedSegments().size()),
+        first_index_in_memory_(file_log_.ActiveFileFirstIndex()) {
+    auto history = make_unique<FileStreamHistory<T>>(file_log_);
+    history_ = history.get();
+    data.SetHistory(std::move(history));
+    file_log_.ReplayActiveFile([&data](T&& entry) { data.Emplace(std::move(entry)); });
+  }
+
+  void Persist(const T& entry, size_t index) override {
+    file_log_.Append(entry, index, OrderKey(entry, index));
+  }
+
+  void PersistBatch(const EntriesRange<T>& entries, size_t first_index) override {
+    std::vector<uint64_t> order_keys;
+    order_keys.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+      order_keys.push_back(OrderKey(entries[i], first_index + i));
+    }
+    file_log_.AppendBatch(entries, first_index, order_keys);
+  }
+
+  std::string Serialize(const T& entry) const override { return storage::SerializeEntryToBinary(entry); }
+
+  void PersistSerialized(const T& entry, const std::string& serialized_entry, size_t index) override {
+    file_log_.AppendSerialized(serialized_entry, index, OrderKey(entry, index));
+  }
+
+  size_t FirstIndexToKeepInMemory() override {
+    if (memory_.Unlimited()) {
+      return first_index_in_memory_;
+    }
+    const std::vector<storage::FileLogSegment>& segments = file_log_.FinalizedSegments();
+    for (; segments_seen_ < segments.size(); ++segments_seen_) {
+      const storage::FileLogSegment& segment = segments[segments_seen_];
+      const uint64_t bytes = bricks::FileSystem::GetFileSize(
+          bricks::FileSystem::JoinPath(file_log_.Directory(), segment.FileName()));
+      finalized_in_memory_.push_back(std::make_pair(segment, bytes));
+      finalized_bytes_in_memory_ += bytes;
+    }
+    bool dropped = false;
+    while (!finalized_in_memory_.empty() && ExceedsMemoryPolicy(finalized_in_memory_.front().first)) {
+      first_index_in_memory_ = finalized_in_memory_.front().first.last_index + 1;
+      finalized_bytes_in_memory_ -= finalized_in_memory_.front().second;
+      finalized_in_memory_.pop_front();
+      dropped = true;
+    }
+    if (dropped) {
+      history_->Update(segments);
+    }
+    return first_index_in_memory_;
   }
 
+  uint64_t BytesPersisted() const override { return file_log_.AppendedBytes(); }
+
+  uint64_t LastOrderKey() const override { return file_log_.LastOrderKey(); }
+
+ private:
+  bool ExceedsMemoryPolicy(const storage::FileLogSegment& oldest_in_memory) const {
+    return file_log_.Size() - first_index_in_memory_ > memory_.max_entries ||
+           finalized_bytes_in_memory_ + file_log_.ActiveFileSize() > memory_.max_bytes ||
+           (HasExtractTimestampMethod<T>(0) &&
+            file_log_.LastOrderKey() - oldest_in_memory.last_order_key > memory_.max_age);
+  }
+
+  storage::FileLog<T> file_log_;
+  const MemoryPolicy memory_;
+  // Owned by `StreamData`.
+  FileStreamHistory<T>* history_;
+  // The finalized files the entries of which are still in memory, along with their sizes.
+  std::deque<std::pair<storage::FileLogSegment, uint64_t>> finalized_in_memory_;
+  uint64_t finalized_bytes_in_memory_ = 0u;
+  size_t segments_seen_;
+  size_t first_index_in_memory_;
+};
+
+// The statistics of the stream, served via HTTP with `?stats`. The latencies are in microseconds.
+struct StreamStats {
+  // Including the entries persisted before the restart.
+  uint64_t entries = 0u;
+  // Since the stream was started, at `entries_per_second` on average.
+  uint64_t entries_published = 0u;
+  double entries_per_second = 0.0;
+  uint64_t bytes_persisted = 0u;
+  uint64_t uptime_ms = 0u;
+  // How long each publish holds the stream, during which no other publisher can add entries to it.
+  stats::LatencyPercentiles publish;
+  // From the entries being made visible to the listeners to the listeners that have caught up getting them.
+  stats::LatencyPercentiles delivery;
+  // The running listeners, including the HTTP subscribers.
+  std::vector<ListenerStats> listeners;
+
+  template <typename A>
+  void serialize(A& ar) {
+    ar(cereal::make_nvp("entries", entries),
+       cereal::make_nvp("entries_published", entries_published),
+       cereal::make_nvp("entries_per_second", entries_per_second),
+       cereal::make_nvp("bytes_persisted", bytes_persisted),
+       cereal::make_nvp("uptime_ms", uptime_ms),
+       cereal::make_nvp("publish", publish),
+       cereal::make_nvp("delivery", delivery),
+       cereal::make_nvp("listeners", listeners));
+  }
+};
+
+// The type-erased part of the stream, for `StreamRegistry` to own the streams of all types.
+// Does not expose the entries, as it would require all the types of them to be serializable.
+class StreamInstanceImplBase {
+ public:
+  virtual ~StreamInstanceImplBase() = default;
+  // Has all the listeners terminate, waits until they are done, and rejects the entries published from now on.
+  virtual void Shutdown() = 0;
+  virtual StreamStats Stats() const = 0;
+};
+
+template <typename T>
+class StreamInstanceImpl final : public StreamInstanceImplBase {
+ public:
+  explicit StreamInstanceImpl(const std::string& name, const std::string& value_name)
+      : name_(name),
+        value_name_(value_name),
+        started_(std::chrono::steady_clock::now()),
+        initial_size_(0u),
+        bytes_persisted_(0u) {}
+
+  // Replays the entries persisted so far into memory, and persists every new entry before the listeners see it.
+  StreamInstanceImpl(const std::string& name, const std::string& value_name, const Persistence& persistence)
+      : name_(name),
+        value_name_(value_name),
+        persister_(make_unique<FileStreamPersister<T>>(
+            bricks::FileSystem::JoinPath(persistence.directory, StreamDirectoryName(name)),
+            persistence,
+            data_)),
+        started_(std::chrono::steady_clock::now()),
+        initial_size_(data_.Size()),
+        bytes_persisted_(0u) {
+    last_order_key_ = persister_->LastOrderKey();
+  }
+
+  // The stream is gone once the registry and all its handles let go of it, and it waits for its listeners.
+  ~StreamInstanceImpl() { Shutdown(); }
+
+  void Shutdown() override { data_.Shutdown(); }
+
+  // Safe to call from any thread. Does not slow down the publishers or the listeners.
+  StreamStats Stats() const override {
+    StreamStats stats;
+    stats.entries = data_.Size();
+    stats.entries_published = stats.entries - initial_size_;
+    const auto uptime = std::chrono::steady_clock::now() - started_;
+    stats.uptime_ms = std::chrono::duration_cast<std::chrono::milliseconds>(uptime).count();
+    const double seconds = std::chrono::duration<double>(uptime).count();
+    stats.entries_per_second = seconds > 0 ? stats.entries_published / seconds : 0.0;
+    stats.bytes_persisted = bytes_persisted_.load(std::memory_order_relaxed);
+    stats.publish = publish_latency_.Percentiles();
+    stats.delivery = data_.DeliveryLatency().Percentiles();
+    stats.listeners = data_.ListenersStats();
+    return stats;
+  }
+
+  // `Publish()` and `Emplace()` return the index of the added entry.
+  size_t Publish(const T& entry) { return DoEmplace(entry); }
+  size_t Publish(T&& entry) { return DoEmplace(std::move(entry)); }
+
   template <typename... ARGS>
   size_t Emplace(const ARGS&... entry_params) {
-    // TODO(dkorolev): Am I not doing this C++11 thing right, or is it not yet supported?
-    // data_.MutableUse([&entry_params](std::vector<T>& data) { data.emplace_back(entry_params...); });
-    auto accesor = data_.MutableScopedAccessor();
-    const size_t index = accesor->size();
-    accesor->emplace_back(entry_params...);
-    return index;
+    return DoEmplace(entry_params...);
+  }
+
+  template <typename ITERATOR>
+  std::pair<size_t, size_t> PublishBatch(ITERATOR begin, ITERATOR end) {
+    ThrowIfShutDown();
+    data_.WaitForListenersBlockingPublisher();
+    if (sequencer_) {
+      return sequencer_->InTurn(sequencer_->Claim(), [&]() { return DoPublishBatch(begin, end); });
+    } else {
+      return DoPublishBatch(begin, end);
+    }
+  }
+
+  // No entries with the timestamp below `head` will be published, so the listeners can stop waiting for them.
+  void UpdateHead(bricks::time::EPOCH_MILLISECONDS head) {
+    ThrowIfShutDown();
+    if (sequencer_) {
+      sequencer_->InTurn(sequencer_->Claim(), [&]() { DoUpdateHead(static_cast<uint64_t>(head)); });
+    } else {
+      DoUpdateHead(static_cast<uint64_t>(head));
+    }
+  }
+
+  // Makes publishing safe from any number of threads at once. Must be called before anything is published.
+  void EnableConcurrentPublishers() {
+    sequencer_ = make_unique<scheduler::Sequencer>();
+  }
+
+  // Passes the entries to the listener, unless it is slow and its `SlowListenerPolicy` has it disconnected
+  // or skip to the new entries. Returns `false` if the listener should not be passed any more entries.
+  template <typename F>
+  static bool PassEntriesToListenerUnlessSlow(StreamData<T>& data,
+                                              F& listener,
+                                              size_t& cursor,
+                                              HistoryReplay<T>& history,
+                                              typename StreamData<T>::ListenerProgress& progress) {
+    data.ListenerMayHaveFallenBehind(progress, cursor);
+    switch (data.SlowListenerAction(progress, cursor)) {
+      case SlowListenerPolicy::Action::Disconnect:
+        CallTerminate(listener);
+        return false;
+      case SlowListenerPolicy::Action::SkipToLive:
+        cursor = data.Size();
+        data.ListenerProgressed(progress, cursor, true);
+        return true;
+      default:
+        break;
+    }
+    const bool keep_going = PassEntriesToListener(data, listener, cursor, history);
+    data.ListenerProgressed(progress, cursor, false);
+    return keep_going;
+  }
+
+  // Called once the listener has been passed all the entries available, before it waits for more.
+  template <typename F>
+  static void CallCaughtUpIfWasBehind(StreamData<T>& data,
+                                      F& listener,
+                                      typename StreamData<T>::ListenerProgress& progress) {
+    if (data.ListenerCaughtUp(progress)) {
+      CallCaughtUp(listener);
+    }
+  }
+
+  // Also called once the listener has been passed all the entries available, for it to learn the head has
+  // moved on. Only for the listeners that define `HeadUpdated()`, which should be woken up when it does.
+  template <typename F>
+  static void CallHeadUpdatedIfMovedOn(StreamData<T>& data,
+                                       F& listener,
+                                       size_t cursor,
+                                       typename StreamData<T>::ListenerProgress& progress) {
+    if (HasHeadUpdatedMethod<F&>(0)) {
+      const uint64_t head = data.ListenerHeadPast(progress, cursor);
+      if (head) {
+        CallHeadUpdated(listener, static_cast<bricks::time::EPOCH_MILLISECONDS>(head));
+      }
+    }
+  }
+
+  template <typename F>
+  static uint64_t HeadToWakeUpPast(const typename StreamData<T>::ListenerProgress& progress) {
+    return HasHeadUpdatedMethod<F&>(0) ? StreamData<T>::HeadPassed(progress) : StreamData<T>::kNoHead;
   }
 
   // `ListenerThread` spawns the thread and runs stream listener within it.
@@ -337,7 +1924,8 @@ class StreamInstanceImpl {
   //    is a legal operation, and it is the way to detach the listener from the caller thread,
   //    enabling to run the listener indefinitely, or until it itself decides to stop.
   //    The most notable example here would be spawning a listener to serve an HTTP request.
-  //    (NOTE: This logic requires `Stream` objects to live forever. TODO(dk+mz): Make sure it is the case.)
+  //    The stream does not go away from under the detached listeners: it has them all terminate,
+  //    and waits for them, before it is destroyed. See `StreamData::Shutdown()`.
   //
   // 2) The alternate usecase is when a stack-allocated object should acts as a listener.
   //    Implementation-wise, it is handled by wrapping the stack-allocated object into a `unique_ptr<>`
@@ -345,22 +1933,37 @@ class StreamInstanceImpl {
   //
   // The `ListenerScope` class handles the above two usecases, depending on whether a stack- or heap-allocated
   // instance of a listener has been passed into.
+  //
+  // Alternatively, the listener can be run on a `scheduler::WorkerPool`, see `PooledListener` below.
+  // The scopes treat both the same way.
+  class ListenerRunner {
+   public:
+    virtual ~ListenerRunner() = default;
+    virtual void SafeJoin() = 0;
+    virtual void PotentiallyUnsafeDetach() = 0;
+  };
+
   template <typename F>
-  class ListenerThread {
+  class ListenerThread final : public ListenerRunner {
    private:
     struct CrossThreadsBlob {
-      bricks::WaitableAtomic<std::vector<T>>& data;
+      StreamData<T>& data;
       F listener;
       std::atomic_bool external_termination_request;
-      std::atomic_bool thread_received_terminate_request;
-      std::atomic_bool thread_done;
+      // Woken up by the stream when there are new entries, and by `SafeJoin()` to have the listener terminate.
+      const std::shared_ptr<scheduler::Event> wakeup;
+      typename StreamData<T>::ListenerProgress progress;
 
-      CrossThreadsBlob(bricks::WaitableAtomic<std::vector<T>>& data, F&& listener)
+      CrossThreadsBlob(StreamData<T>& data, F&& listener, size_t from_index, const SlowListenerPolicy& policy)
           : data(data),
             listener(std::move(listener)),
             external_termination_request(false),
-            thread_received_terminate_request(false),
-            thread_done(false) {}
+            wakeup(std::make_shared<scheduler::Event>()),
+            progress(from_index, policy) {
+        data.ListenerStarted(progress);
+      }
+
+      bool TerminationRequested() const { return external_termination_request || data.ShutdownRequested(); }
 
       CrossThreadsBlob() = delete;
       CrossThreadsBlob(const CrossThreadsBlob&) = delete;
@@ -370,10 +1973,9 @@ class StreamInstanceImpl {
     };
 
    public:
-    ListenerThread(bricks::WaitableAtomic<std::vector<T>>& data, F&& listener)
-        : data_(data),
-          blob_(std::make_shared<CrossThreadsBlob>(data, std::move(listener))),
-          thread_(&ListenerThread::StaticListenerThread, blob_) {}
+    ListenerThread(StreamData<T>& data, F&& listener, size_t from_index, const SlowListenerPolicy& policy)
+        : blob_(std::make_shared<CrossThreadsBlob>(data, std::move(listener), from_index, policy)),
+          thread_(&ListenerThread::StaticListenerThread, blob_, from_index) {}
 
     ~ListenerThread() {
       if (thread_.joinable()) {
@@ -382,96 +1984,77 @@ class StreamInstanceImpl {
       }
     }
 
-    void SafeJoinThread() {
+    void SafeJoin() override {
       assert(thread_.joinable());  // TODO(dkorolev): Exception && test?
-      // Buzz all active listeners. Ineffective, but does the right thing semantically, and passes the test.
+      // Only this listener is woken up. If it is not waiting at the moment, the wakeup is not lost,
+      // and it will see the request before it waits next time.
       blob_->external_termination_request = true;
-      data_.Notify();
-      // This loop, along with polling logic in the thread, is our Chamberlain's Response to deadlocks.
-      const auto now = bricks::time::Now();
-      while (!blob_->thread_received_terminate_request && !blob_->thread_done) {
-        // Spin lock if under 2ms. Start sending notifications nonstop afterwards.
-        if (static_cast<uint64_t>(bricks::time::Now() - now) >= 2) {
-          data_.Notify();
-        }
-      }
+      blob_->wakeup->Wake();
       // Wait for the thread to terminate.
       // Note that this code will only be executed if neither `Join()` nor `Detach()` has been done before.
       thread_.join();
     }
 
-    void PotentiallyUnsafeDetachThread() {
+    void PotentiallyUnsafeDetach() override {
       assert(thread_.joinable());  // TODO(dkorolev): Exception && test?
       thread_.detach();
     }
 
-    static void StaticListenerThread(std::shared_ptr<CrossThreadsBlob> blob_shared_ptr) {
+    static void StaticListenerThread(std::shared_ptr<CrossThreadsBlob> blob_shared_ptr, size_t from_index) {
       CrossThreadsBlob* blob = blob_shared_ptr.get();
       assert(blob);
-      size_t cursor = 0;
-      volatile bool user_already_notified_to_terminate = false;
-      volatile bool has_data;
+      RunListener(blob, from_index);
+      // Only now the stream can be gone, as the history replay of this listener has been destroyed.
+      blob->data.ListenerDone(blob->progress);
+    }
+
+    static void RunListener(CrossThreadsBlob* blob, size_t from_index) {
+      // No entries before `from_index` are looked at. If it is beyond the end of the stream,
+      // the listener waits for the entry with this index to be published.
+      size_t cursor = from_index;
+      HistoryReplay<T> history(blob->data);
+      bool user_already_notified_to_terminate = false;
       while (true) {
-        has_data = false;
-        blob->data.WaitFor(
-            [&blob, &cursor, &user_already_notified_to_terminate, &has_data](const std::vector<T>& data) {
-              if (!user_already_notified_to_terminate && blob->external_termination_request) {
-                return true;
-              } else if (data.size() > cursor) {
-                has_data = true;
-                return true;
-              } else {
-                return false;
-              }
-            },
-            static_cast<bricks::time::MILLISECONDS_INTERVAL>(10));
-        // This condition, along with the timeout in `WaitFor`, is our Chamberlain's Response to deadlocks.
-        if (!user_already_notified_to_terminate && blob->external_termination_request) {
-          blob->thread_received_terminate_request = true;
+        // Only wait if there is no new data and no pending termination request.
+        // Reading the data itself does not require taking any locks.
+        if (blob->data.Size() <= cursor) {
+          CallCaughtUpIfWasBehind(blob->data, blob->listener, blob->progress);
+          CallHeadUpdatedIfMovedOn(blob->data, blob->listener, cursor, blob->progress);
+          if (user_already_notified_to_terminate || !blob->TerminationRequested()) {
+            blob->data.WaitFor(cursor,
+                               blob->wakeup,
+                               !user_already_notified_to_terminate,
+                               HeadToWakeUpPast<F>(blob->progress));
+          }
+        }
+        if (!user_already_notified_to_terminate && blob->TerminationRequested()) {
           user_already_notified_to_terminate = true;
           if (CallTerminate(blob->listener)) {
             break;
           }
         }
-        if (has_data) {  // action == NEW_DATA_READY) {
-          bool user_initiated_terminate = false;
-          blob->data.ImmutableUse([&blob, &cursor, &user_initiated_terminate](const std::vector<T>& data) {
-            // Entries are often instances of polymorphic types, that make it into various message queues.
-            // The most straightforward way to store them is a `unique_ptr`, and the most straightforward
-            // way to pass `unique_ptr`-s between threads is via `Emplace*(ptr.release())`.
-            // If `Entry()` is being passed immutable records, the pain of cloning data from `unique_ptr`-s
-            // becomes the user's pain. This shall not be allowed.
-            //
-            // Thus, here we need to make a copy.
-            // The below implementation is imperfect, but it serves the purpose semantically.
-            // TODO(dkorolev): Fix it.
-
-            assert(cursor < data.size());
-            const std::string json = JSON(data[cursor]);
-            T copy_of_entry;
-            try {
-              ParseJSON(json, copy_of_entry);
-            } catch (const std::exception& e) {
-              std::cerr << "Something went terribly wrong." << std::endl;
-              std::cerr << e.what();
-              ::exit(-1);
-            }
-
-            // TODO(dkorolev): Perhaps RTTI dispatching here.
-            if (!blob->listener->Entry(copy_of_entry, cursor, data.size())) {
-              user_initiated_terminate = true;
-            }
-            ++cursor;
-          });
+        if (blob->data.Size() > cursor) {
+          // Entries are often instances of polymorphic types, that make it into various message queues.
+          // The most straightforward way to store them is a `unique_ptr`, and the most straightforward
+          // way to pass `unique_ptr`-s between threads is via `Emplace*(ptr.release())`.
+          // If `Entry()` is being passed mutable records, the pain of cloning data from `unique_ptr`-s
+          // should not become the user's pain.
+          //
+          // Thus, listeners accepting `const T&` are passed the stored entry as is,
+          // and the ones accepting `T&` are passed a copy, see `CloneEntry()`.
+          // Listeners defining `EntryBatch()` are passed all the available entries at once.
+          //
+          // The history of persistent streams is read from the storage in chunks, and the entries read
+          // are owned by this thread, so they are passed to the listener with no extra copies.
+          const bool user_initiated_terminate =
+              !PassEntriesToListenerUnlessSlow(blob->data, blob->listener, cursor, history, blob->progress);
           if (user_initiated_terminate) {
             break;
           }
         }
       }
-      blob->thread_done = true;
     }
 
-    bricks::WaitableAtomic<std::vector<T>>& data_;  // Just to `.Notify()` when terminating.
     std::shared_ptr<CrossThreadsBlob> blob_;
     std::thread thread_;
 
@@ -483,11 +2066,144 @@ class StreamInstanceImpl {
     void operator=(ListenerThread&&) = delete;
   };
 
+  // The listener run on a pool. It is run when there are new entries for it, or when it should terminate,
+  // and it registers itself to be woken up by the stream once it has caught up, instead of waiting.
+  // The semantics of `Entry()`, `EntryBatch()`, `CaughtUp()` and `Terminate()` are the same as for the threads.
+  template <typename F>
+  class PooledListener final : public scheduler::SerialTask {
+   public:
+    // Bounds the time one listener occupies the worker, so that the others get their share when replaying.
+    enum { kMaxCallsPerStep = 256 };
+
+    PooledListener(scheduler::WorkerPool& pool,
+                   StreamData<T>& data,
+                   F&& listener,
+                   size_t from_index,
+                   const SlowListenerPolicy& policy)
+        : scheduler::SerialTask(pool),
+          data_(data),
+          listener_(std::move(listener)),
+          cursor_(from_index),
+          history_(make_unique<HistoryReplay<T>>(data)),
+          progress_(from_index, policy),
+          external_termination_request_(false),
+          user_already_notified_to_terminate_(false),
+          done_(false) {
+      data_.ListenerStarted(progress_);
+    }
+
+    void RequestTermination() {
+      external_termination_request_ = true;
+      Wake();
+    }
+
+    void WaitUntilDone() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_variable_.wait(lock, [this]() { return done_; });
+    }
+
+   private:
+    bool Step() override {
+      if (done_) {
+        return false;  // A late wakeup.
+      }
+      if (!user_already_notified_to_terminate_ && TerminationRequested()) {
+        user_already_notified_to_terminate_ = true;
+        if (CallTerminate(listener_)) {
+          Done();
+          return false;
+        }
+      }
+      for (size_t calls = 0; calls < kMaxCallsPerStep && data_.Size() > cursor_; ++calls) {
+        if (!PassEntriesToListenerUnlessSlow(data_, listener_, cursor_, *history_, progress_)) {
+          Done();
+          return false;
+        }
+      }
+      if (data_.Size() > cursor_) {
+        return true;
+      }
+      CallCaughtUpIfWasBehind(data_, listener_, progress_);
+      CallHeadUpdatedIfMovedOn(data_, listener_, cursor_, progress_);
+      data_.WakeUpWhenAvailable(
+          cursor_, shared_from_this(), !user_already_notified_to_terminate_, HeadToWakeUpPast<F>(progress_));
+      return false;
+    }
+
+    bool TerminationRequested() const { return external_termination_request_ || data_.ShutdownRequested(); }
+
+    // The stream may be gone once this listener is done, so it lets go of the history replay first.
+    void Done() {
+      history_.reset();
+      data_.ListenerDone(progress_);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+      }
+      condition_variable_.notify_all();
+    }
+
+    StreamData<T>& data_;
+    F listener_;
+    size_t cursor_;
+    std::unique_ptr<HistoryReplay<T>> history_;
+    typename StreamData<T>::ListenerProgress progress_;
+    std::atomic_bool external_termination_request_;
+    bool user_already_notified_to_terminate_;
+    bool done_;  // Only changed by `Step()`, read by `WaitUntilDone()` under the mutex.
+    std::mutex mutex_;
+    std::condition_variable condition_variable_;
+  };
+
+  // Owns the pooled listener until it is joined or detached. Once detached, the listener is kept alive
+  // by the pool and by the stream, for as long as it runs.
+  template <typename F>
+  class PooledListenerRunner final : public ListenerRunner {
+   public:
+    PooledListenerRunner(scheduler::WorkerPool& pool,
+                         StreamData<T>& data,
+                         F&& listener,
+                         size_t from_index,
+                         const SlowListenerPolicy& policy)
+        : listener_(std::make_shared<PooledListener<F>>(pool, data, std::move(listener), from_index, policy)) {
+      listener_->Wake();
+    }
+
+    ~PooledListenerRunner() {
+      if (listener_) {
+        throw std::logic_error("Unrecoverable error in destructor: PooledListener was not joined/detached.");
+      }
+    }
+
+    void SafeJoin() override {
+      assert(listener_);
+      listener_->RequestTermination();
+      listener_->WaitUntilDone();
+      listener_.reset();
+    }
+
+    void PotentiallyUnsafeDetach() override {
+      assert(listener_);
+      listener_.reset();
+    }
+
+   private:
+    std::shared_ptr<PooledListener<F>> listener_;
+  };
+
   template <typename F>
   class AsyncListenerScope {
    public:
-    AsyncListenerScope(bricks::WaitableAtomic<std::vector<T>>& data, F&& listener)
-        : impl_(make_unique<ListenerThread<F>>(data, std::forward<F>(listener))) {}
+    AsyncListenerScope(StreamData<T>& data, F&& listener, size_t from_index, const SlowListenerPolicy& policy)
+        : impl_(make_unique<ListenerThread<F>>(data, std::forward<F>(listener), from_index, policy)) {}
+
+    AsyncListenerScope(StreamData<T>& data,
+                       F&& listener,
+                       size_t from_index,
+                       const SlowListenerPolicy& policy,
+                       scheduler::WorkerPool& pool)
+        : impl_(make_unique<PooledListenerRunner<F>>(
+              pool, data, std::forward<F>(listener), from_index, policy)) {}
 
     AsyncListenerScope(AsyncListenerScope&& rhs) : impl_(std::move(rhs.impl_)) {
       assert(impl_);
@@ -496,15 +2212,15 @@ class StreamInstanceImpl {
 
     void Join() {
       assert(impl_);
-      impl_->SafeJoinThread();
+      impl_->SafeJoin();
     }
     void Detach() {
       assert(impl_);
-      impl_->PotentiallyUnsafeDetachThread();
+      impl_->PotentiallyUnsafeDetach();
     }
 
    private:
-    std::unique_ptr<ListenerThread<F>> impl_;
+    std::unique_ptr<ListenerRunner> impl_;
 
     AsyncListenerScope() = delete;
     AsyncListenerScope(const AsyncListenerScope&) = delete;
@@ -515,8 +2231,17 @@ class StreamInstanceImpl {
   template <typename F>
   class SyncListenerScope {
    public:
-    SyncListenerScope(bricks::WaitableAtomic<std::vector<T>>& data, F&& listener)
-        : joined_(false), impl_(make_unique<ListenerThread<F>>(data, std::move(listener))) {}
+    SyncListenerScope(StreamData<T>& data, F&& listener, size_t from_index, const SlowListenerPolicy& policy)
+        : joined_(false),
+          impl_(make_unique<ListenerThread<F>>(data, std::move(listener), from_index, policy)) {}
+
+    SyncListenerScope(StreamData<T>& data,
+                      F&& listener,
+                      size_t from_index,
+                      const SlowListenerPolicy& policy,
+                      scheduler::WorkerPool& pool)
+        : joined_(false),
+          impl_(make_unique<PooledListenerRunner<F>>(pool, data, std::move(listener), from_index, policy)) {}
 
     SyncListenerScope(SyncListenerScope&& rhs) : joined_(false), impl_(std::move(rhs.impl_)) {
       // TODO(dkorolev): Constructor is not destructor -- we can make these exceptions and test them.
@@ -536,13 +2261,13 @@ class StreamInstanceImpl {
       // TODO(dkorolev): Make these exceptions and test them.
       assert(!joined_);
       assert(impl_);
-      impl_->SafeJoinThread();
+      impl_->SafeJoin();
       joined_ = true;
     }
 
    private:
     bool joined_;
-    std::unique_ptr<ListenerThread<F>> impl_;
+    std::unique_ptr<ListenerRunner> impl_;
 
     SyncListenerScope() = delete;
     SyncListenerScope(const SyncListenerScope&) = delete;
@@ -552,26 +2277,213 @@ class StreamInstanceImpl {
 
   // Expose the means to create both a sync ("scoped") and async ("detachable") listeners.
   template <typename F>
-  AsyncListenerScope<F> AsyncSubscribeImpl(F&& listener) {
+  AsyncListenerScope<F> AsyncSubscribeImpl(F&& listener, size_t from_index) {
     // No `std::move()` needed: RAAI.
-    return AsyncListenerScope<F>(data_, std::forward<F>(listener));
+    return AsyncListenerScope<F>(data_, std::forward<F>(listener), from_index, listener_policy_);
   }
 
   template <typename F>
-  SyncListenerScope<PretendingToBeUniquePtr<F>> SyncSubscribeImpl(F& listener) {
+  SyncListenerScope<PretendingToBeUniquePtr<F>> SyncSubscribeImpl(F& listener, size_t from_index) {
     // No `std::move()` needed: RAAI.
-    return SyncListenerScope<PretendingToBeUniquePtr<F>>(data_, PretendingToBeUniquePtr<F>(listener));
+    return SyncListenerScope<PretendingToBeUniquePtr<F>>(
+        data_, PretendingToBeUniquePtr<F>(listener), from_index, listener_policy_);
+  }
+
+  template <typename F>
+  AsyncListenerScope<F> AsyncSubscribeImpl(F&& listener, size_t from_index, scheduler::WorkerPool& pool) {
+    return AsyncListenerScope<F>(data_, std::forward<F>(listener), from_index, listener_policy_, pool);
   }
 
+  template <typename F>
+  SyncListenerScope<PretendingToBeUniquePtr<F>> SyncSubscribeImpl(F& listener,
+                                                                  size_t from_index,
+                                                                  scheduler::WorkerPool& pool) {
+    return SyncListenerScope<PretendingToBeUniquePtr<F>>(
+        data_, PretendingToBeUniquePtr<F>(listener), from_index, listener_policy_, pool);
+  }
+
+  size_t Size() const { return data_.Size(); }
+
+  // For the listeners reading from many streams at once, see `merge/merge.h`.
+  StreamData<T>& Data() { return data_; }
+
+  std::vector<ListenerStats> ListenersStats() const { return data_.ListenersStats(); }
+
+  // Must be called before the stream is exposed via HTTP.
+  void ServeHTTPSubscribersOn(scheduler::WorkerPool& pool) { http_listeners_pool_ = &pool; }
+
+  // Apply to the listeners that subscribe from now on.
+  void SetSlowListenerPolicy(const SlowListenerPolicy& policy) { listener_policy_ = policy; }
+  void SetSlowHTTPSubscriberPolicy(const SlowListenerPolicy& policy) { http_listener_policy_ = policy; }
+
   void ServeDataViaHTTP(Request r) {
-    AsyncSubscribeImpl(make_unique<PubSubHTTPEndpoint<T>>(value_name_, std::move(r))).Detach();
+    if (r.url.query.has("stats")) {
+      r(Stats(), "stats");
+      return;
+    }
+    // Allocated once the stream has HTTP subscribers, as most streams never do.
+    std::call_once(encoded_entries_allocated_,
+                   [this]() { encoded_entries_ = make_unique<EncodedEntriesCache>(); });
+    auto endpoint = make_unique<PubSubHTTPEndpoint<T>>(value_name_, std::move(r), encoded_entries_.get());
+    const size_t from_index = endpoint->FirstIndexToServe(data_);
+    if (endpoint->NothingToServe(from_index, data_.Size())) {
+      return;  // Ends the response right away.
+    }
+    typedef std::unique_ptr<PubSubHTTPEndpoint<T>> endpoint_t;
+    if (http_listeners_pool_) {
+      AsyncListenerScope<endpoint_t>(
+          data_, std::move(endpoint), from_index, http_listener_policy_, *http_listeners_pool_).Detach();
+    } else {
+      AsyncListenerScope<endpoint_t>(data_, std::move(endpoint), from_index, http_listener_policy_).Detach();
+    }
   }
 
  private:
+  template <typename... ARGS>
+  size_t DoEmplace(ARGS&&... args) {
+    ThrowIfShutDown();
+    data_.WaitForListenersBlockingPublisher();
+    if (sequencer_) {
+      return DoPublishConcurrently(T(std::forward<ARGS>(args)...));
+    }
+    const stats::ScopedLatency publish_latency(publish_latency_);
+    uint64_t order_key = 0u;
+    const size_t index = data_.EmplaceAndCommit(
+        [this, &order_key](const T& entry, size_t i) {
+          order_key = OrderKey(entry, i);
+          CheckOrderKeyIsNotBeforeHead(order_key);
+          if (persister_) {
+            persister_->Persist(entry, i);
+          }
+        },
+        std::forward<ARGS>(args)...);
+    last_order_key_ = order_key;
+    DropFromMemoryIfNeeded();
+    return index;
+  }
+
+  // The entry has been constructed, and is serialized, in parallel with the other publishers,
+  // and is only added to the stream in the turn of this one.
+  size_t DoPublishConcurrently(T&& entry) {
+    const uint64_t ticket = sequencer_->Claim();
+    std::string serialized_entry;
+    if (persister_) {
+      try {
+        serialized_entry = persister_->Serialize(entry);
+      } catch (...) {
+        sequencer_->Skip(ticket);
+        throw;
+      }
+    }
+    return sequencer_->InTurn(ticket, [&]() {
+      const stats::ScopedLatency publish_latency(publish_latency_);
+      const size_t index = data_.Size();
+      const uint64_t order_key = OrderKey(entry, index);
+      CheckOrderKeyFollows(last_order_key_, order_key);
+      CheckOrderKeyIsNotBeforeHead(order_key);
+      if (persister_) {
+        data_.EmplaceAndCommit(
+            [&](const T& added, size_t i) { persister_->PersistSerialized(added, serialized_entry, i); },
+            std::move(entry));
+      } else {
+        data_.Emplace(std::move(entry));
+      }
+      last_order_key_ = order_key;
+      DropFromMemoryIfNeeded();
+      return index;
+    });
+  }
+
+  template <typename ITERATOR>
+  std::pair<size_t, size_t> DoPublishBatch(ITERATOR begin, ITERATOR end) {
+    const stats::ScopedLatency publish_latency(publish_latency_);
+    uint64_t last_order_key = last_order_key_;
+    const size_t first_index = data_.AppendAndCommit(
+        [this, &last_order_key](const typename StreamData<T>::StagedEntries& entries, size_t index) {
+          for (size_t i = 0; i < entries.size(); ++i) {
+            const uint64_t order_key = OrderKey(entries[i], index + i);
+            if (sequencer_) {
+              CheckOrderKeyFollows(last_order_key, order_key);
+            }
+            CheckOrderKeyIsNotBeforeHead(order_key);
+            last_order_key = order_key;
+          }
+          if (persister_) {
+            persister_->PersistBatch(EntriesRange<T>(entries, 0u, entries.size()), index);
+          }
+        },
+        begin,
+        end);
+    last_order_key_ = last_order_key;
+    DropFromMemoryIfNeeded();
+    return std::make_pair(first_index, data_.Size());
+  }
+
+  // The listeners would not see the entries published after the shutdown, so they are rejected.
+  void ThrowIfShutDown() const {
+    if (data_.ShutdownRequested()) {
+      throw StreamIsShutDownException(name_);
+    }
+  }
+
+  // Keeps the entries of persistent streams in memory within their `MemoryPolicy`. Called after every publish.
+  void DropFromMemoryIfNeeded() {
+    if (persister_) {
+      data_.DropFromMemory(persister_->FirstIndexToKeepInMemory());
+      bytes_persisted_.store(persister_->BytesPersisted(), std::memory_order_relaxed);
+    }
+  }
+
+  // With concurrent publishers, the order of the entries is only decided as they take their turns,
+  // so it is Sherlock that ensures their timestamps do not go back in time. The order key of the entry
+  // published last is kept aside, as the entry itself may have been dropped from memory already.
+  void CheckOrderKeyFollows(uint64_t previous, uint64_t order_key) const {
+    if (order_key < previous) {
+      throw InconsistentTimestampException(previous, order_key);
+    }
+  }
+
+  // The listeners have been told no entries before the head will follow, so, unlike the order of the entries,
+  // this is checked for every publisher. The entries are discarded before the listeners see them.
+  void CheckOrderKeyIsNotBeforeHead(uint64_t order_key) const {
+    if (order_key < head_) {
+      throw InconsistentTimestampException(head_, order_key);
+    }
+  }
+
+  // The head can not go back in time, nor precede the last entry, including the ones only in the history.
+  void DoUpdateHead(uint64_t head) {
+    if (head < std::max(head_, last_order_key_)) {
+      throw InconsistentTimestampException(std::max(head_, last_order_key_), head);
+    }
+    head_ = head;
+    data_.UpdateHead(head);
+  }
+
   const std::string name_;
   const std::string value_name_;
-  // FTR: This is really an inefficient reference implementation. TODO(dkorolev): Revisit it.
-  bricks::WaitableAtomic<std::vector<T>> data_;
+  StreamData<T> data_;
+  // Null for in-memory streams.
+  std::unique_ptr<StreamPersister<T>> persister_;
+  // For `Stats()`.
+  const std::chrono::steady_clock::time_point started_;
+  const size_t initial_size_;
+  std::atomic<uint64_t> bytes_persisted_;
+  stats::LatencyHistogram publish_latency_;
+  // Null unless the HTTP subscribers should be served by a pool instead of by a thread each.
+  scheduler::WorkerPool* http_listeners_pool_ = nullptr;
+  // Null until the stream has been subscribed to via HTTP.
+  std::once_flag encoded_entries_allocated_;
+  std::unique_ptr<EncodedEntriesCache> encoded_entries_;
+  // What happens to the listeners that fall behind, set apart for the HTTP subscribers.
+  SlowListenerPolicy listener_policy_;
+  SlowListenerPolicy http_listener_policy_;
+  // Null unless there may be concurrent publishers.
+  std::unique_ptr<scheduler::Sequencer> sequencer_;
+  // The last head set via `UpdateHead()`, which the entries published after it must not precede.
+  uint64_t head_ = 0u;
+  // The order key of the entry published last, set in the turn of its publisher. Zero if there are none.
+  uint64_t last_order_key_ = 0u;
 
   StreamInstanceImpl() = delete;
   StreamInstanceImpl(const StreamInstanceImpl&) = delete;
@@ -591,10 +2503,11 @@ struct can_be_stored_in_unique_ptr<std::unique_ptr<B>, E> {
   static constexpr bool value = std::is_same<B, E>::value || std::is_base_of<B, E>::value;
 };
 
+// The handle to the stream. Shares the ownership of the stream with `StreamRegistry` and other handles.
 template <typename T>
 struct StreamInstance {
-  StreamInstanceImpl<T>* impl_;
-  explicit StreamInstance(StreamInstanceImpl<T>* impl) : impl_(impl) {}
+  std::shared_ptr<StreamInstanceImpl<T>> impl_;
+  explicit StreamInstance(std::shared_ptr<StreamInstanceImpl<T>> impl) : impl_(std::move(impl)) {}
 
   size_t Publish(const T& entry) { return impl_->Publish(entry); }
   size_t Publish(T&& entry) { return impl_->Publish(std::move(entry)); }
@@ -604,14 +2517,43 @@ struct StreamInstance {
     return impl_->Emplace(entry_params...);
   }
 
-  // TODO(dkorolev): EmplacePolymorphic, that does `new`.
+  // Publishes the entries from `[begin, end)` at once: the listeners are woken up once for all of them,
+  // and, for persistent streams, they are written and flushed together. Use `std::make_move_iterator()`
+  // to have the entries moved into the stream. Returns the `[first, last + 1)` range of their indexes.
+  template <typename ITERATOR>
+  std::pair<size_t, size_t> PublishBatch(ITERATOR begin, ITERATOR end) {
+    return impl_->PublishBatch(begin, end);
+  }
+
+  template <typename CONTAINER>
+  std::pair<size_t, size_t> PublishBatch(const CONTAINER& entries) {
+    return impl_->PublishBatch(entries.begin(), entries.end());
+  }
+
+  // Tells the listeners the stream is complete up to `head`, with no new entries. See the comment at the top.
+  void UpdateHead(bricks::time::EPOCH_MILLISECONDS head) { impl_->UpdateHead(head); }
+
+  // Makes all of the above safe to call from any number of threads at once. See the comment at the top.
+  void EnableConcurrentPublishers() { impl_->EnableConcurrentPublishers(); }
+
+  // The number of entries in the stream, including the ones persisted before the restart.
+  size_t Size() const { return impl_->Size(); }
 
-  // TODO(dkorolev): Add a test for this code.
-  // TODO(dkorolev): Perhaps eliminate the copy.
+  // For polymorphic streams of `std::unique_ptr<B>`, publishes an instance of `E`, derived from `B`.
+  // Moves the entry into the stream if passed an rvalue, and copies it otherwise.
   template <typename E>
-  typename std::enable_if<can_be_stored_in_unique_ptr<T, E>::value, size_t>::type Publish(const E& e) {
-    // TODO(dkorolev): Don't rely on the existence of copy constructor.
-    return impl_->Emplace(new E(e));
+  typename std::enable_if<can_be_stored_in_unique_ptr<T, typename std::decay<E>::type>::value, size_t>::type
+  Publish(E&& e) {
+    return EmplacePolymorphic<typename std::decay<E>::type>(std::forward<E>(e));
+  }
+
+  // Constructs the instance of `E` in place from `args`. If `B` derives from `storage::ArenaAllocated<B>`,
+  // the memory for it comes from the arena instead of the heap. See `storage/arena.h`.
+  template <typename E, typename... ARGS>
+  typename std::enable_if<can_be_stored_in_unique_ptr<T, E>::value, size_t>::type EmplacePolymorphic(
+      ARGS&&... args) {
+    // Own the entry right away, so that it is freed should publishing it throw.
+    return impl_->Publish(T(new E(std::forward<ARGS>(args)...)));
   }
 
   template <typename F>
@@ -624,30 +2566,143 @@ struct StreamInstance {
   // should ensure to terminate itself, when initiated from within the destructor of `SyncListenerScope`.
   // Note that the destructor of `SyncListenerScope` will wait until the listener terminates, thus,
   // not terminating as requested may result in the calling thread blocking for an unbounded amount of time.
+  //
+  // Both kinds of subscriptions start from the entry with the index of `from_index`, zero by default,
+  // without looking at the entries that precede it.
   template <typename F>
-  SyncListenerScope<bricks::rmconstref<F>> SyncSubscribe(F& listener) {
+  SyncListenerScope<bricks::rmconstref<F>> SyncSubscribe(F& listener, size_t from_index = 0u) {
     // No `std::move()` needed: RAAI.
-    return impl_->SyncSubscribeImpl(listener);
+    return impl_->SyncSubscribeImpl(listener, from_index);
   }
 
   // Aynchonous subscription: `listener` is a heap-allocated object, the ownership of which
   // can be `std::move()`-d into the listening thread. It can be `Join()`-ed or `Detach()`-ed.
   template <typename F>
-  AsyncListenerScope<bricks::rmconstref<F>> AsyncSubscribe(F&& listener) {
+  AsyncListenerScope<bricks::rmconstref<F>> AsyncSubscribe(F&& listener, size_t from_index = 0u) {
     // No `std::move()` needed: RAAI.
-    return impl_->AsyncSubscribeImpl(std::forward<F>(listener));
+    return impl_->AsyncSubscribeImpl(std::forward<F>(listener), from_index);
+  }
+
+  // Same as the above, but the listener is run on `pool` instead of in a dedicated thread.
+  // The pool must outlive the listener. See `scheduler/pool.h`.
+  template <typename F>
+  SyncListenerScope<bricks::rmconstref<F>> SyncSubscribe(F& listener,
+                                                         scheduler::WorkerPool& pool,
+                                                         size_t from_index = 0u) {
+    return impl_->SyncSubscribeImpl(listener, from_index, pool);
+  }
+
+  template <typename F>
+  AsyncListenerScope<bricks::rmconstref<F>> AsyncSubscribe(F&& listener,
+                                                           scheduler::WorkerPool& pool,
+                                                           size_t from_index = 0u) {
+    return impl_->AsyncSubscribeImpl(std::forward<F>(listener), from_index, pool);
+  }
+
+  // Have the listeners serving the HTTP subscribers of this stream run on `pool`.
+  void ServeHTTPSubscribersOn(scheduler::WorkerPool& pool) { impl_->ServeHTTPSubscribersOn(pool); }
+
+  // What happens to the listeners that fall behind: see `SlowListenerPolicy`. Both apply to the listeners
+  // subscribed from now on; the HTTP subscribers have a policy of their own, as they are the usual slow ones.
+  void SetSlowListenerPolicy(const SlowListenerPolicy& policy) { impl_->SetSlowListenerPolicy(policy); }
+  void SetSlowHTTPSubscriberPolicy(const SlowListenerPolicy& policy) {
+    impl_->SetSlowHTTPSubscriberPolicy(policy);
   }
 
+  // How far behind each of the running listeners is, including the HTTP subscribers.
+  std::vector<ListenerStats> ListenersStats() const { return impl_->ListenersStats(); }
+
+  // The same as served via HTTP with `?stats`. Cheap enough to be called often.
+  StreamStats Stats() const { return impl_->Stats(); }
+
   void operator()(Request r) { impl_->ServeDataViaHTTP(std::move(r)); }
 };
 
+// All the streams of the process, by their names. The names are unique.
+// The registry owns the streams: they outlive the handles returned by `Stream()`, until shut down.
+class StreamRegistry final {
+ public:
+  // The stream is constructed under the lock, so that the files of a persistent stream are never opened twice.
+  template <typename T, typename... ARGS>
+  StreamInstance<T> Add(const std::string& name, ARGS&&... args) {
+    // TODO(dkorolev): Validate stream name, add exceptions and tests for it.
+    // TODO(dkorolev): Chat with the team if stream names should be case-sensitive, allowed symbols, etc.
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (streams_.count(name)) {
+      throw StreamAlreadyExistsException(name);
+    }
+    auto stream = std::make_shared<StreamInstanceImpl<T>>(name, std::forward<ARGS>(args)...);
+    streams_[name] = stream;
+    return StreamInstance<T>(std::move(stream));
+  }
+
+  template <typename T>
+  StreamInstance<T> Find(const std::string& name) const {
+    auto stream = std::dynamic_pointer_cast<StreamInstanceImpl<T>>(FindStream(name));
+    if (!stream) {
+      throw StreamTypeMismatchException(name);
+    }
+    return StreamInstance<T>(std::move(stream));
+  }
+
+  bool Has(const std::string& name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return streams_.count(name) != 0u;
+  }
+
+  // Sorted.
+  std::vector<std::string> Names() const {
+    std::vector<std::string> names;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& stream : streams_) {
+      names.push_back(stream.first);
+    }
+    return names;
+  }
+
+  // Removes the stream, so that its name can be reused, has its listeners terminate, and waits for them.
+  // The stream itself is gone once the last handle to it is, and publishing into it throws until then.
+  // Must not be called from a listener of this stream, see `StreamData::Shutdown()`.
+  void Shutdown(const std::string& name) {
+    std::shared_ptr<StreamInstanceImplBase> stream = FindStream(name);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      streams_.erase(name);
+    }
+    stream->Shutdown();
+  }
+
+ private:
+  std::shared_ptr<StreamInstanceImplBase> FindStream(const std::string& name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto cit = streams_.find(name);
+    if (cit == streams_.end()) {
+      throw StreamNotFoundException(name);
+    }
+    return cit->second;
+  }
+
+  mutable std::mutex mutex_;
+  std::map<std::string, std::shared_ptr<StreamInstanceImplBase>> streams_;
+};
+
+// Sherlock runs as a singleton. Never destroyed, so that the detached listeners can outlive `main()`.
+inline StreamRegistry& Streams() {
+  static StreamRegistry* registry = new StreamRegistry();
+  return *registry;
+}
+
+// Throws `StreamAlreadyExistsException` if the stream of this name exists already.
 template <typename T>
 StreamInstance<T> Stream(const std::string& name, const std::string& value_name = "entry") {
-  // TODO(dkorolev): Validate stream name, add exceptions and tests for it.
-  // TODO(dkorolev): Chat with the team if stream names should be case-sensitive, allowed symbols, etc.
-  // TODO(dkorolev): Ensure no streams with the same name are being added. Add an exception for it.
-  // TODO(dkorolev): Add the persistence layer.
-  return StreamInstance<T>(new StreamInstanceImpl<T>(name, value_name));
+  return Streams().Add<T>(name, value_name);
+}
+
+template <typename T>
+StreamInstance<T> Stream(const std::string& name,
+                         const Persistence& persistence,
+                         const std::string& value_name = "entry") {
+  return Streams().Add<T>(name, value_name, persistence);
 }
 
 }  // namespace sherlock
@@ -0,0 +1,173 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// The latency histogram for the statistics of the streams, cheap enough to be always on.
+//
+// The latencies are counted in power-of-two buckets of microseconds, so recording one is a few relaxed
+// atomic increments, with no locks. The threads recording latencies at once are spread across stripes,
+// each on its own cache lines, so that they do not contend for the same counters.
+
+#ifndef SHERLOCK_STATS_HISTOGRAM_H
+#define SHERLOCK_STATS_HISTOGRAM_H
+
+#include "../../Bricks/port.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+#include "../../Bricks/cerealize/cerealize.h"
+
+namespace sherlock {
+namespace stats {
+
+// The summary of the latencies recorded. The percentiles are the upper bounds of their buckets,
+// so they are accurate to within a factor of two.
+struct LatencyPercentiles {
+  uint64_t count = 0u;
+  double mean_us = 0.0;
+  uint64_t p50_us = 0u;
+  uint64_t p90_us = 0u;
+  uint64_t p99_us = 0u;
+  uint64_t max_us = 0u;
+
+  template <typename A>
+  void serialize(A& ar) {
+    ar(cereal::make_nvp("count", count),
+       cereal::make_nvp("mean_us", mean_us),
+       cereal::make_nvp("p50_us", p50_us),
+       cereal::make_nvp("p90_us", p90_us),
+       cereal::make_nvp("p99_us", p99_us),
+       cereal::make_nvp("max_us", max_us));
+  }
+};
+
+class LatencyHistogram final {
+ public:
+  // Bucket `b` counts the latencies of `[2^(b-1), 2^b)` microseconds, and bucket zero the ones below one.
+  // The last bucket also counts everything above, which is days.
+  enum { kBuckets = 40 };
+  enum { kStripes = 8 };
+
+  LatencyHistogram() {
+    for (Stripe& stripe : stripes_) {
+      for (std::atomic<uint64_t>& bucket : stripe.buckets) {
+        bucket.store(0u, std::memory_order_relaxed);
+      }
+      stripe.sum_us.store(0u, std::memory_order_relaxed);
+    }
+  }
+
+  // Safe to call from any thread.
+  void Add(std::chrono::steady_clock::duration latency) {
+    const int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    const uint64_t value = us > 0 ? static_cast<uint64_t>(us) : 0u;
+    Stripe& stripe = stripes_[std::hash<std::thread::id>()(std::this_thread::get_id()) % kStripes];
+    stripe.buckets[Bucket(value)].fetch_add(1u, std::memory_order_relaxed);
+    stripe.sum_us.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  // Safe to call from any thread. The latencies recorded meanwhile may or may not be accounted for.
+  LatencyPercentiles Percentiles() const {
+    uint64_t counts[kBuckets] = {0u};
+    uint64_t sum_us = 0u;
+    for (const Stripe& stripe : stripes_) {
+      for (size_t b = 0; b < kBuckets; ++b) {
+        counts[b] += stripe.buckets[b].load(std::memory_order_relaxed);
+      }
+      sum_us += stripe.sum_us.load(std::memory_order_relaxed);
+    }
+    LatencyPercentiles result;
+    for (size_t b = 0; b < kBuckets; ++b) {
+      result.count += counts[b];
+    }
+    if (!result.count) {
+      return result;
+    }
+    result.mean_us = static_cast<double>(sum_us) / result.count;
+    result.p50_us = Percentile(counts, result.count, 50u);
+    result.p90_us = Percentile(counts, result.count, 90u);
+    result.p99_us = Percentile(counts, result.count, 99u);
+    result.max_us = Percentile(counts, result.count, 100u);
+    return result;
+  }
+
+  static size_t Bucket(uint64_t us) {
+    size_t b = 0u;
+    while (us && b + 1 < kBuckets) {
+      us >>= 1;
+      ++b;
+    }
+    return b;
+  }
+
+  // The largest latency counted in bucket `b`, in microseconds.
+  static uint64_t UpperBound(size_t b) { return b ? (uint64_t(1) << b) - 1u : 0u; }
+
+ private:
+  static uint64_t Percentile(const uint64_t (&counts)[kBuckets], uint64_t total, uint64_t percent) {
+    // The smallest bucket such that at least `percent` of the latencies are in it or below.
+    const uint64_t rank = (total * percent + 99u) / 100u;
+    uint64_t seen = 0u;
+    for (size_t b = 0; b < kBuckets; ++b) {
+      seen += counts[b];
+      if (seen >= rank) {
+        return UpperBound(b);
+      }
+    }
+    return UpperBound(kBuckets - 1);
+  }
+
+  struct Stripe {
+    std::atomic<uint64_t> buckets[kBuckets];
+    std::atomic<uint64_t> sum_us;
+    char padding[64];  // Keeps the stripes off each other's cache lines.
+  };
+  Stripe stripes_[kStripes];
+
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  void operator=(const LatencyHistogram&) = delete;
+};
+
+// Records the time from its construction to its destruction.
+class ScopedLatency final {
+ public:
+  explicit ScopedLatency(LatencyHistogram& histogram)
+      : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedLatency() { histogram_.Add(std::chrono::steady_clock::now() - start_); }
+
+ private:
+  LatencyHistogram& histogram_;
+  const std::chrono::steady_clock::time_point start_;
+
+  ScopedLatency(const ScopedLatency&) = delete;
+  void operator=(const ScopedLatency&) = delete;
+};
+
+}  // namespace stats
+}  // namespace sherlock
+
+#endif  // SHERLOCK_STATS_HISTOGRAM_H
@@ -0,0 +1,84 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+#include "histogram.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../../Bricks/dflags/dflags.h"
+#include "../../Bricks/3party/gtest/gtest-main-with-dflags.h"
+
+using sherlock::stats::LatencyHistogram;
+using sherlock::stats::LatencyPercentiles;
+using std::chrono::microseconds;
+
+TEST(LatencyHistogram, CountsLatenciesInPowerOfTwoBuckets) {
+  EXPECT_EQ(0u, LatencyHistogram::Bucket(0u));
+  EXPECT_EQ(1u, LatencyHistogram::Bucket(1u));
+  EXPECT_EQ(2u, LatencyHistogram::Bucket(2u));
+  EXPECT_EQ(2u, LatencyHistogram::Bucket(3u));
+  EXPECT_EQ(3u, LatencyHistogram::Bucket(4u));
+  EXPECT_EQ(10u, LatencyHistogram::Bucket(1000u));
+  EXPECT_EQ(LatencyHistogram::kBuckets - 1u, LatencyHistogram::Bucket(~uint64_t(0)));
+  EXPECT_EQ(1023u, LatencyHistogram::UpperBound(LatencyHistogram::Bucket(1000u)));
+}
+
+TEST(LatencyHistogram, ReportsPercentilesAsUpperBoundsOfTheirBuckets) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(0u, histogram.Percentiles().count);
+  for (int i = 0; i < 90; ++i) {
+    histogram.Add(microseconds(10));
+  }
+  for (int i = 0; i < 9; ++i) {
+    histogram.Add(microseconds(100));
+  }
+  histogram.Add(microseconds(10000));
+  const LatencyPercentiles percentiles = histogram.Percentiles();
+  EXPECT_EQ(100u, percentiles.count);
+  EXPECT_DOUBLE_EQ((90 * 10 + 9 * 100 + 10000) / 100.0, percentiles.mean_us);
+  EXPECT_EQ(15u, percentiles.p50_us);
+  EXPECT_EQ(15u, percentiles.p90_us);
+  EXPECT_EQ(127u, percentiles.p99_us);
+  EXPECT_EQ(16383u, percentiles.max_us);
+}
+
+TEST(LatencyHistogram, CountsLatenciesFromManyThreads) {
+  LatencyHistogram histogram;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&histogram]() {
+      for (int i = 0; i < 10000; ++i) {
+        histogram.Add(microseconds(i % 100));
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(80000u, histogram.Percentiles().count);
+  EXPECT_EQ(127u, histogram.Percentiles().max_us);
+}
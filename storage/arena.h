@@ -0,0 +1,149 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// The arena for the entries of polymorphic streams, which are otherwise allocated one by one from the heap.
+//
+// Memory is carved out of large slabs in blocks of a few fixed sizes. A freed block goes to the free list
+// of its size and is reused by the next allocation of that size; the slabs themselves are only returned
+// when the arena is destroyed. Since stream entries are rarely, if ever, freed, most allocations end up
+// being a pointer bump under an uncontended lock.
+//
+// Derive the base class of the entries from `ArenaAllocated<BASE>` to have all of its derived classes
+// allocated this way. The base class must have a virtual destructor, so that `operator delete` is passed
+// the size of the object being deleted, not of its base.
+
+#ifndef SHERLOCK_STORAGE_ARENA_H
+#define SHERLOCK_STORAGE_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace sherlock {
+namespace storage {
+
+class Arena final {
+ public:
+  static constexpr size_t kGranularity = 16;
+  static constexpr size_t kMaxPooledSize = 512;
+  static constexpr size_t kSlabSize = 64 * 1024;
+  static_assert(kGranularity % alignof(std::max_align_t) == 0, "Arena blocks must be suitably aligned.");
+
+  Arena() = default;
+
+  // Objects larger than `kMaxPooledSize` bytes are passed through to the global `operator new`.
+  void* Allocate(size_t size) {
+    if (size > kMaxPooledSize) {
+      return ::operator new(size);
+    }
+    const size_t block_size = BlockSize(size);
+    SizeClass& size_class = classes_[block_size / kGranularity - 1];
+    std::lock_guard<std::mutex> lock(size_class.mutex);
+    if (size_class.free_list) {
+      FreeBlock* block = size_class.free_list;
+      size_class.free_list = block->next;
+      return block;
+    }
+    if (size_class.end - size_class.next < static_cast<std::ptrdiff_t>(block_size)) {
+      size_class.slabs.emplace_back(new char[kSlabSize]);
+      size_class.next = size_class.slabs.back().get();
+      size_class.end = size_class.next + kSlabSize;
+    }
+    void* result = size_class.next;
+    size_class.next += block_size;
+    return result;
+  }
+
+  // `size` must be the same as the one passed to `Allocate()`.
+  void Deallocate(void* p, size_t size) {
+    if (!p) {
+      return;
+    }
+    if (size > kMaxPooledSize) {
+      ::operator delete(p);
+      return;
+    }
+    SizeClass& size_class = classes_[BlockSize(size) / kGranularity - 1];
+    std::lock_guard<std::mutex> lock(size_class.mutex);
+    FreeBlock* block = static_cast<FreeBlock*>(p);
+    block->next = size_class.free_list;
+    size_class.free_list = block;
+  }
+
+  // The number of slabs allocated so far, for the tests.
+  size_t Slabs() {
+    size_t result = 0;
+    for (SizeClass& size_class : classes_) {
+      std::lock_guard<std::mutex> lock(size_class.mutex);
+      result += size_class.slabs.size();
+    }
+    return result;
+  }
+
+ private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  struct SizeClass {
+    std::mutex mutex;
+    FreeBlock* free_list = nullptr;
+    char* next = nullptr;
+    char* end = nullptr;
+    std::vector<std::unique_ptr<char[]>> slabs;
+  };
+
+  static size_t BlockSize(size_t size) {
+    return size ? (size + kGranularity - 1) / kGranularity * kGranularity : kGranularity;
+  }
+
+  SizeClass classes_[kMaxPooledSize / kGranularity];
+
+  Arena(const Arena&) = delete;
+  void operator=(const Arena&) = delete;
+};
+
+// One arena per `BASE`, shared by all the streams of `std::unique_ptr<BASE>`.
+template <typename BASE>
+struct ArenaAllocated {
+  static void* operator new(size_t size) { return GetArena().Allocate(size); }
+  static void operator delete(void* p, size_t size) { GetArena().Deallocate(p, size); }
+
+  // Declaring the above hides the placement form, which is still needed to construct entries in place.
+  static void* operator new(size_t, void* p) { return p; }
+  static void operator delete(void*, void*) {}
+
+  static Arena& GetArena() {
+    // Leaked on purpose, as the streams themselves are: entries may well be freed during static destruction.
+    static Arena* arena = new Arena();
+    return *arena;
+  }
+};
+
+}  // namespace storage
+}  // namespace sherlock
+
+#endif  // SHERLOCK_STORAGE_ARENA_H
@@ -0,0 +1,183 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Publisher vs. listeners contention benchmark.
+//
+// Compares the lock-free `sherlock::StreamData<T>` with the reference implementation it has replaced:
+// `bricks::WaitableAtomic<std::vector<T>>`, where the publisher and every listener take the same mutex
+// for each and every entry.
+//
+// Also measures the latency of waking up the listener that has gone to sleep waiting for the next entry.
+//
+// Usage: `make all && ./.noshit/benchmark --entries=1000000 --listeners=8 --wakeups=1000`.
+
+#include "../sherlock.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../../Bricks/waitable_atomic/waitable_atomic.h"
+#include "../../Bricks/dflags/dflags.h"
+
+DEFINE_int32(entries, 1000000, "The number of entries to publish.");
+DEFINE_int32(listeners, 8, "The number of concurrent listeners.");
+DEFINE_int32(wakeups, 1000, "The number of entries to measure the wakeup latency on.");
+
+struct Entry {
+  uint64_t value;
+  explicit Entry(uint64_t value = 0u) : value(value) {}
+};
+
+// The reference implementation: one mutex for the publisher and all the listeners.
+struct WaitableAtomicImpl {
+  static const char* Name() { return "WaitableAtomic<std::vector<T>>"; }
+
+  bricks::WaitableAtomic<std::vector<Entry>> data;
+
+  void Publish(uint64_t value) { data.MutableScopedAccessor()->emplace_back(value); }
+
+  uint64_t Listen(size_t total) {
+    uint64_t sum = 0u;
+    for (size_t cursor = 0; cursor < total; ++cursor) {
+      data.WaitFor([cursor](const std::vector<Entry>& data) { return data.size() > cursor; },
+                   static_cast<bricks::time::MILLISECONDS_INTERVAL>(10));
+      data.ImmutableUse([&sum, cursor](const std::vector<Entry>& data) { sum += data[cursor].value; });
+    }
+    return sum;
+  }
+};
+
+// The lock-free append log with an atomic commit index.
+struct StreamDataImpl {
+  static const char* Name() { return "sherlock::StreamData<T>"; }
+
+  sherlock::StreamData<Entry> data;
+
+  void Publish(uint64_t value) { data.Emplace(value); }
+
+  uint64_t Listen(size_t total) {
+    uint64_t sum = 0u;
+    size_t cursor = 0;
+    const auto wakeup = std::make_shared<sherlock::scheduler::Event>();
+    while (cursor < total) {
+      const size_t size = data.Size();
+      if (size > cursor) {
+        while (cursor < size) {
+          sum += data[cursor++].value;
+        }
+      } else {
+        data.WaitFor(cursor, wakeup);
+      }
+    }
+    return sum;
+  }
+};
+
+template <typename IMPL>
+void Run(size_t entries, size_t listeners) {
+  IMPL impl;
+  const uint64_t expected_sum = static_cast<uint64_t>(entries) * (entries - 1) / 2;
+  std::atomic_size_t mismatches(0u);
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < listeners; ++i) {
+    threads.emplace_back([&impl, &mismatches, entries, expected_sum]() {
+      if (impl.Listen(entries) != expected_sum) {
+        ++mismatches;
+      }
+    });
+  }
+  for (size_t i = 0; i < entries; ++i) {
+    impl.Publish(i);
+  }
+  const auto published = std::chrono::steady_clock::now();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const auto done = std::chrono::steady_clock::now();
+  const double publish_ns =
+      static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(published - start).count());
+  const double total_ns =
+      static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(done - start).count());
+  std::printf("%-32s publish: %8.1f ns/entry, delivery: %8.2f M entries/s%s\n",
+              IMPL::Name(),
+              publish_ns / entries,
+              1e3 * entries * listeners / total_ns,
+              mismatches ? " (MISMATCH!)" : "");
+}
+
+// Publishes each entry once the listener has had the time to go to sleep, and reports the percentiles
+// of the time it takes the listener to see it.
+void RunWakeups(size_t entries) {
+  typedef std::chrono::steady_clock clock;
+  sherlock::StreamData<Entry> data;
+  std::vector<clock::time_point> published_at(entries);
+  std::vector<clock::time_point> seen_at(entries);
+  std::atomic_size_t seen(0u);
+  std::thread listener([&data, &seen_at, &seen, entries]() {
+    const auto wakeup = std::make_shared<sherlock::scheduler::Event>();
+    for (size_t cursor = 0; cursor < entries; ++cursor) {
+      while (data.Size() <= cursor) {
+        data.WaitFor(cursor, wakeup);
+      }
+      seen_at[cursor] = clock::now();
+      ++seen;
+    }
+  });
+  for (size_t i = 0; i < entries; ++i) {
+    std::this_thread::sleep_for(std::chrono::microseconds(200));  // Let the listener go to sleep.
+    published_at[i] = clock::now();
+    data.Emplace(i);
+    while (seen <= i) {
+      ;  // Spin lock.
+    }
+  }
+  listener.join();
+  std::vector<double> latencies_us;
+  for (size_t i = 0; i < entries; ++i) {
+    latencies_us.push_back(std::chrono::duration<double, std::micro>(seen_at[i] - published_at[i]).count());
+  }
+  std::sort(latencies_us.begin(), latencies_us.end());
+  std::printf("%-32s wakeup: p50 %8.1f us, p99 %8.1f us\n",
+              "sherlock::StreamData<T>",
+              latencies_us[entries / 2],
+              latencies_us[entries * 99 / 100]);
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  const size_t entries = static_cast<size_t>(FLAGS_entries);
+  const size_t listeners = static_cast<size_t>(FLAGS_listeners);
+  std::printf("%d entries, %d listeners.\n", FLAGS_entries, FLAGS_listeners);
+  Run<WaitableAtomicImpl>(entries, listeners);
+  Run<StreamDataImpl>(entries, listeners);
+  if (FLAGS_wakeups > 0) {
+    RunWakeups(static_cast<size_t>(FLAGS_wakeups));
+  }
+}
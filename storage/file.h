@@ -0,0 +1,775 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// The persistent storage for the entries of Sherlock streams, as per `design-doc.md`.
+//
+// The stream is stored in its own directory, as a sequence of append-only files:
+// * The `active` file, which is currently appended to, and
+// * The finalized files, the names of which carry the first and last indexes and the first and last order keys
+//   of the entries they contain. Thus, only the names of finalized files have to be scanned to locate an entry.
+//
+// The active file is finalized, i.e. renamed, and a new one is started as soon as appending the next entry
+// to it would violate the `FileLogPolicy`: the cap on the number of entries, on the size of the file,
+// or on the time window the file spans, when order keys are timestamps.
+//
+// The files are written and read sequentially. Each file starts with a header carrying the type signature
+// of the stream, which is checked when the file is read. It is followed by length-prefixed binary records:
+//
+//   uint32 payload length | uint32 CRC-32 of the rest | uint64 index | uint64 order key | payload
+//
+// where the payload is the Cereal-binary-serialized entry, and all integers are little-endian.
+//
+// If the process died in the middle of writing a record, the incomplete or corrupted tail of the active file
+// is dropped on the next start. Corrupted finalized files are reported as errors.
+//
+// Opening the log does not read the entries. The finalized files are immutable, and are read by mapping them
+// into memory, with no system calls or copies per record, see `FinalizedFilesReader`.
+
+#ifndef SHERLOCK_STORAGE_FILE_H
+#define SHERLOCK_STORAGE_FILE_H
+
+#include "../../Bricks/port.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../Bricks/exception.h"
+#include "../../Bricks/file/file.h"
+#include "../../Bricks/cerealize/cerealize.h"
+
+#include "crc32.h"
+
+namespace sherlock {
+namespace storage {
+
+struct StorageException : bricks::Exception {
+  explicit StorageException(const std::string& what) : bricks::Exception(what) {}
+};
+
+// The defaults follow the design doc: 100M entries, 10MB, 24 hours.
+struct FileLogPolicy {
+  uint64_t max_entries_per_file = 100ull * 1000 * 1000;
+  uint64_t max_file_size = 10ull * 1024 * 1024;
+  // Only applies when the order keys are timestamps, in milliseconds.
+  uint64_t max_file_time_window = 24ull * 60 * 60 * 1000;
+};
+
+// A finalized file, fully described by its name.
+struct FileLogSegment {
+  uint64_t first_index;
+  uint64_t last_index;
+  uint64_t first_order_key;
+  uint64_t last_order_key;
+
+  // Zero-padded, so that the lexicographical order of file names is their chronological order.
+  std::string FileName() const {
+    char buffer[128];
+    ::snprintf(buffer,
+               sizeof(buffer),
+               "finalized.%020" PRIu64 "-%020" PRIu64 ".%020" PRIu64 "-%020" PRIu64,
+               first_index,
+               last_index,
+               first_order_key,
+               last_order_key);
+    return buffer;
+  }
+
+  static bool FromFileName(const std::string& file_name, FileLogSegment& output) {
+    FileLogSegment segment;
+    int length = 0;
+    if (::sscanf(file_name.c_str(),
+                 "finalized.%" SCNu64 "-%" SCNu64 ".%" SCNu64 "-%" SCNu64 "%n",
+                 &segment.first_index,
+                 &segment.last_index,
+                 &segment.first_order_key,
+                 &segment.last_order_key,
+                 &length) == 4 &&
+        static_cast<size_t>(length) == file_name.length() && segment.first_index <= segment.last_index) {
+      output = segment;
+      return true;
+    } else {
+      return false;
+    }
+  }
+};
+
+// Fixed-width little-endian integers, so that the files are portable.
+inline void AppendLittleEndian(std::string& output, uint64_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; ++i) {
+    output += static_cast<char>((value >> (i * 8)) & 0xff);
+  }
+}
+
+inline uint64_t ParseLittleEndian(const char* input, size_t bytes) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < bytes; ++i) {
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(input[i])) << (i * 8);
+  }
+  return value;
+}
+
+constexpr char kFileLogMagic[] = "SHERLOCK";
+constexpr size_t kFileLogMagicSize = 8;
+constexpr uint32_t kFileLogFormatVersion = 1;
+
+inline std::string FileLogHeader(const std::string& type_signature) {
+  std::string header(kFileLogMagic, kFileLogMagicSize);
+  AppendLittleEndian(header, kFileLogFormatVersion, 4);
+  AppendLittleEndian(header, type_signature.length(), 4);
+  header += type_signature;
+  return header;
+}
+
+// One record of the log. `index` and `order_key` are kept along with the entry to validate the files,
+// and to not have to deserialize the entries to learn their order keys.
+struct FileLogRecordHeader {
+  static constexpr size_t kSize = 24;
+  uint32_t payload_length;
+  uint32_t crc32;
+  uint64_t index;
+  uint64_t order_key;
+
+  static FileLogRecordHeader Parse(const char* input) {
+    FileLogRecordHeader header;
+    header.payload_length = static_cast<uint32_t>(ParseLittleEndian(input, 4));
+    header.crc32 = static_cast<uint32_t>(ParseLittleEndian(input + 4, 4));
+    header.index = ParseLittleEndian(input + 8, 8);
+    header.order_key = ParseLittleEndian(input + 16, 8);
+    return header;
+  }
+
+  // The checksum covers everything but the length and the checksum itself: a corrupted length
+  // either points beyond the end of the file, or makes the checksum mismatch.
+  static uint32_t Checksum(const char* index_and_order_key, const char* payload, size_t payload_length) {
+    return CRC32(payload, payload_length, CRC32(index_and_order_key, 16));
+  }
+};
+
+inline std::string FileLogRecord(const std::string& payload, uint64_t index, uint64_t order_key) {
+  std::string record;
+  record.reserve(FileLogRecordHeader::kSize + payload.length());
+  AppendLittleEndian(record, payload.length(), 4);
+  AppendLittleEndian(record, 0u, 4);  // The placeholder for the checksum.
+  AppendLittleEndian(record, index, 8);
+  AppendLittleEndian(record, order_key, 8);
+  record += payload;
+  const uint32_t crc32 = FileLogRecordHeader::Checksum(&record[8], payload.data(), payload.length());
+  for (size_t i = 0; i < 4; ++i) {
+    record[4 + i] = static_cast<char>((crc32 >> (i * 8)) & 0xff);
+  }
+  return record;
+}
+
+template <typename T>
+std::string SerializeEntryToBinary(const T& entry) {
+  std::ostringstream os;
+  {
+    cereal::BinaryOutputArchive ar(os);
+    ar(entry);
+  }
+  return os.str();
+}
+
+// Deserializes the entry right from where it is, ex. from the file mapped into memory, with no copies made.
+class MemoryStreamBuffer final : public std::streambuf {
+ public:
+  MemoryStreamBuffer(const char* data, size_t length) {
+    char* begin = const_cast<char*>(data);  // The buffer is only read from.
+    setg(begin, begin, begin + length);
+  }
+};
+
+template <typename T>
+void ParseEntryFromBinary(const char* payload, size_t length, T& entry) {
+  MemoryStreamBuffer buffer(payload, length);
+  std::istream is(&buffer);
+  cereal::BinaryInputArchive ar(is);
+  ar(entry);
+}
+
+// A read-only file mapped into memory. Since the files are read front to back, the kernel is advised so,
+// to read ahead aggressively and to drop the pages that have been read.
+class MappedFile final {
+ public:
+  explicit MappedFile(const std::string& file_name) : file_name_(file_name), data_(nullptr), size_(0u) {
+    const int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw StorageException("Can not open `" + file_name + "`.");
+    }
+    struct stat info;
+    if (::fstat(fd, &info)) {
+      ::close(fd);
+      throw StorageException("Can not stat `" + file_name + "`.");
+    }
+    size_ = static_cast<size_t>(info.st_size);
+    if (size_) {
+      void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        ::close(fd);
+        throw StorageException("Can not map `" + file_name + "` into memory.");
+      }
+      data_ = static_cast<const char*>(data);
+      ::madvise(data, size_, MADV_SEQUENTIAL);
+      ::madvise(data, size_, MADV_WILLNEED);
+    }
+    ::close(fd);  // The mapping stays valid.
+  }
+
+  ~MappedFile() {
+    if (data_) {
+      ::munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  const std::string& FileName() const { return file_name_; }
+  const char* Data() const { return data_; }
+  size_t Size() const { return size_; }
+
+ private:
+  const std::string file_name_;
+  const char* data_;
+  size_t size_;
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile(MappedFile&&) = delete;
+  void operator=(const MappedFile&) = delete;
+  void operator=(MappedFile&&) = delete;
+};
+
+// Walks the records of one file of the log, mapped into memory.
+class FileLogReader final {
+ public:
+  enum class Status { Record, End, Incomplete, Corrupted };
+
+  explicit FileLogReader(const MappedFile& file) : file_(file), offset_(0u) {}
+
+  // Returns `false` if the file is too short to contain the header. Throws if the header does not match.
+  bool ReadHeader(const std::string& type_signature) {
+    const std::string expected = FileLogHeader(type_signature);
+    const std::string actual(file_.Data(), std::min(expected.length(), file_.Size()));
+    if (actual != expected) {
+      if (actual.length() < expected.length() && expected.compare(0, actual.length(), actual) == 0) {
+        return false;
+      }
+      if (actual.compare(0, kFileLogMagicSize, expected, 0, kFileLogMagicSize)) {
+        throw StorageException("`" + file_.FileName() + "` is not a Sherlock stream file.");
+      }
+      throw StorageException("`" + file_.FileName() + "` has a different format version or type signature.");
+    }
+    offset_ = expected.length();
+    return true;
+  }
+
+  // On success, `payload` points to the `header.payload_length` bytes of the entry within the mapped file.
+  Status Next(FileLogRecordHeader& header, const char*& payload) {
+    const size_t remaining = file_.Size() - offset_;
+    if (!remaining) {
+      return Status::End;
+    }
+    if (remaining < FileLogRecordHeader::kSize) {
+      return Status::Incomplete;
+    }
+    const char* raw_header = file_.Data() + offset_;
+    header = FileLogRecordHeader::Parse(raw_header);
+    if (remaining - FileLogRecordHeader::kSize < header.payload_length) {
+      return Status::Incomplete;
+    }
+    payload = raw_header + FileLogRecordHeader::kSize;
+    if (FileLogRecordHeader::Checksum(raw_header + 8, payload, header.payload_length) != header.crc32) {
+      return Status::Corrupted;
+    }
+    offset_ += FileLogRecordHeader::kSize + header.payload_length;
+    return Status::Record;
+  }
+
+  // The size of the header and of all the valid records read so far.
+  size_t Offset() const { return offset_; }
+
+  // Goes back to the previously returned `Offset()`, to have the records after it returned again.
+  void Rewind(size_t offset) {
+    assert(offset <= offset_);
+    offset_ = offset;
+  }
+
+ private:
+  const MappedFile& file_;
+  size_t offset_;
+};
+
+template <typename T>
+T DeserializeRecord(const MappedFile& file, const FileLogRecordHeader& header, const char* payload) {
+  T entry;
+  try {
+    ParseEntryFromBinary(payload, header.payload_length, entry);
+  } catch (const std::exception& e) {
+    throw StorageException("Can not deserialize entry " + std::to_string(header.index) + " in `" +
+                           file.FileName() + "`: " + e.what());
+  }
+  return entry;
+}
+
+// Reads the entries of finalized files sequentially, with one file at a time mapped into memory.
+// Finalized files are immutable, so any number of readers can be used concurrently, one per thread.
+template <typename T>
+class FinalizedFilesReader final {
+ public:
+  FinalizedFilesReader(const std::string& directory,
+                       const std::vector<FileLogSegment>& segments,
+                       const std::string& type_signature)
+      : directory_(directory), segments_(segments), type_signature_(type_signature) {}
+
+  // The number of entries in the finalized files, which always start from index zero.
+  uint64_t Size() const { return segments_.empty() ? 0u : segments_.back().last_index + 1; }
+
+  // Appends up to `max_entries` entries, starting from `index`, to `output`. Reading consecutive ranges
+  // does not involve any lookups.
+  void Read(uint64_t index, size_t max_entries, std::vector<T>& output) {
+    assert(index < Size());
+    if (!reader_ || index != next_index_) {
+      Seek(index);
+    }
+    FileLogRecordHeader header;
+    const char* payload;
+    while (max_entries && next_index_ < Size()) {
+      if (next_index_ > segments_[segment_].last_index) {
+        Open(segment_ + 1);
+      }
+      if (reader_->Next(header, payload) != FileLogReader::Status::Record || header.index != next_index_) {
+        ThrowCorruptedRecord();
+      }
+      output.push_back(DeserializeRecord<T>(*file_, header, payload));
+      ++next_index_;
+      --max_entries;
+    }
+  }
+
+  // Returns the index of the first entry with the order key not less than `order_key`, or `Size()` if there is
+  // none, and positions the reader at it. The order keys are non-decreasing, so the file is found by the order
+  // keys in the names of the files, and only the records of that one file are looked at, without deserializing.
+  uint64_t LowerBound(uint64_t order_key) {
+    const auto cit = std::lower_bound(segments_.begin(),
+                                      segments_.end(),
+                                      order_key,
+                                      [](const FileLogSegment& segment, uint64_t key) {
+                                        return segment.last_order_key < key;
+                                      });
+    if (cit == segments_.end()) {
+      return Size();
+    }
+    Open(static_cast<size_t>(cit - segments_.begin()));
+    FileLogRecordHeader header;
+    const char* payload;
+    while (true) {
+      const size_t offset = reader_->Offset();
+      if (reader_->Next(header, payload) != FileLogReader::Status::Record || header.index != next_index_) {
+        ThrowCorruptedRecord();
+      }
+      if (header.order_key >= order_key) {
+        reader_->Rewind(offset);
+        return next_index_;
+      }
+      ++next_index_;
+    }
+  }
+
+ private:
+  void ThrowCorruptedRecord() const {
+    throw StorageException("Corrupted record " + std::to_string(next_index_) + " in `" + file_->FileName() +
+                           "`.");
+  }
+
+  void Seek(uint64_t index) {
+    const auto cit = std::upper_bound(segments_.begin(),
+                                      segments_.end(),
+                                      index,
+                                      [](uint64_t i, const FileLogSegment& segment) {
+                                        return i < segment.first_index;
+                                      });
+    assert(cit != segments_.begin());
+    Open(static_cast<size_t>(cit - segments_.begin()) - 1);
+    // Only the headers of the records are looked at to skip them.
+    FileLogRecordHeader header;
+    const char* payload;
+    while (next_index_ < index) {
+      if (reader_->Next(header, payload) != FileLogReader::Status::Record) {
+        ThrowCorruptedRecord();
+      }
+      ++next_index_;
+    }
+  }
+
+  void Open(size_t segment) {
+    reader_.reset();
+    file_.reset();
+    segment_ = segment;
+    file_ = make_unique<MappedFile>(bricks::FileSystem::JoinPath(directory_, segments_[segment].FileName()));
+    reader_ = make_unique<FileLogReader>(*file_);
+    if (!reader_->ReadHeader(type_signature_)) {
+      throw StorageException("`" + file_->FileName() + "` has no header.");
+    }
+    next_index_ = segments_[segment].first_index;
+  }
+
+  const std::string directory_;
+  const std::vector<FileLogSegment> segments_;
+  const std::string type_signature_;
+
+  size_t segment_ = 0u;
+  std::unique_ptr<MappedFile> file_;
+  std::unique_ptr<FileLogReader> reader_;
+  uint64_t next_index_ = 0u;
+};
+
+template <typename T>
+class FileLog final {
+ public:
+  // Opens the log in `directory`, creating the directory if necessary, to append entries from `Size()` on.
+  // Files with a type signature other than `type_signature` are rejected.
+  //
+  // No entries are deserialized here. The finalized files are only looked up by their names, and the records
+  // of the active file are validated, to drop the incomplete tail left behind if the process has died while
+  // writing to it. Use `FinalizedFilesReader` and `ReplayActiveFile()` to read the entries.
+  FileLog(const std::string& directory,
+          const FileLogPolicy& policy,
+          const std::string& type_signature,
+          bool order_keys_are_timestamps)
+      : directory_(directory),
+        active_file_name_(bricks::FileSystem::JoinPath(directory, "active")),
+        policy_(policy),
+        file_header_(FileLogHeader(type_signature)),
+        type_signature_(type_signature),
+        order_keys_are_timestamps_(order_keys_are_timestamps) {
+    bricks::FileSystem::MkDir(directory_, bricks::FileSystem::MkDirParameters::Silent);
+    ScanFinalizedFiles();
+    RecoverActiveFile();
+    active_.open(active_file_name_, std::ios::binary | std::ios::app);
+    if (!active_) {
+      throw StorageException("Can not open `" + active_file_name_ + "` for writing.");
+    }
+    if (!active_size_) {
+      WriteToActiveFile(file_header_);
+      active_size_ = file_header_.length();
+    }
+  }
+
+  const std::string& Directory() const { return directory_; }
+  const std::string& TypeSignature() const { return type_signature_; }
+
+  // The total number of entries persisted, which is also the index of the next one.
+  uint64_t Size() const { return next_index_; }
+
+  const std::vector<FileLogSegment>& FinalizedSegments() const { return segments_; }
+
+  // The index of the first entry in the active file, which is also the number of entries in finalized files.
+  uint64_t ActiveFileFirstIndex() const { return next_index_ - active_entries_; }
+
+  // In bytes, including the header.
+  uint64_t ActiveFileSize() const { return active_size_; }
+
+  // The bytes of the records appended since the log was opened.
+  uint64_t AppendedBytes() const { return appended_bytes_; }
+
+  // The order key of the last entry persisted, zero if there are none.
+  uint64_t LastOrderKey() const {
+    if (active_entries_) {
+      return active_last_order_key_;
+    } else {
+      return segments_.empty() ? 0u : segments_.back().last_order_key;
+    }
+  }
+
+  // Passes the entries of the active file into `f(T&& entry)`, in order.
+  // Must only be called from the publisher thread.
+  template <typename F>
+  void ReplayActiveFile(F&& f) const {
+    if (!active_entries_) {
+      return;
+    }
+    const MappedFile file(active_file_name_);
+    FileLogReader reader(file);
+    reader.ReadHeader(type_signature_);
+    FileLogRecordHeader header;
+    const char* payload;
+    for (uint64_t i = 0; i < active_entries_; ++i) {
+      if (reader.Next(header, payload) != FileLogReader::Status::Record) {
+        throw StorageException("`" + active_file_name_ + "` has changed.");
+      }
+      f(DeserializeRecord<T>(file, header, payload));
+    }
+  }
+
+  // Must only be called from the publisher thread.
+  void Append(const T& entry, uint64_t index, uint64_t order_key) {
+    AppendSerialized(SerializeEntryToBinary(entry), index, order_key);
+  }
+
+  // Same as `Append()`, for the entry already serialized via `SerializeEntryToBinary()`, which, unlike
+  // this call, is safe to make from any thread.
+  void AppendSerialized(const std::string& payload, uint64_t index, uint64_t order_key) {
+    CheckNextIndex(index);
+    AppendRecords(std::vector<std::string>(1u, FileLogRecord(payload, index, order_key)),
+                  std::vector<uint64_t>(1u, order_key));
+  }
+
+  // Appends consecutive entries at once, which makes them the unit of group commit: they are written out
+  // and flushed together, once per file if they span several. `entries[i]` is the entry with the index of
+  // `first_index + i`, and `order_keys[i]` is its order key. Nothing is written if any entry fails
+  // to serialize, and if writing any of them fails, none are kept.
+  // Must only be called from the publisher thread.
+  template <typename ENTRIES>
+  void AppendBatch(const ENTRIES& entries, uint64_t first_index, const std::vector<uint64_t>& order_keys) {
+    CheckNextIndex(first_index);
+    std::vector<std::string> records;
+    records.reserve(order_keys.size());
+    for (size_t i = 0; i < order_keys.size(); ++i) {
+      records.push_back(FileLogRecord(SerializeEntryToBinary(entries[i]), first_index + i, order_keys[i]));
+    }
+    AppendRecords(records, order_keys);
+  }
+
+  // Renames the active file into a finalized one and starts a new active file. No-op if it is empty.
+  void Finalize() {
+    if (!active_entries_) {
+      return;
+    }
+    FileLogSegment segment;
+    segment.first_index = next_index_ - active_entries_;
+    segment.last_index = next_index_ - 1;
+    segment.first_order_key = active_first_order_key_;
+    segment.last_order_key = active_last_order_key_;
+    active_.close();
+    bricks::FileSystem::RenameFile(active_file_name_,
+                                   bricks::FileSystem::JoinPath(directory_, segment.FileName()));
+    segments_.push_back(segment);
+    active_entries_ = 0;
+    active_.open(active_file_name_, std::ios::binary | std::ios::trunc);
+    if (!active_) {
+      throw StorageException("Can not open `" + active_file_name_ + "` for writing.");
+    }
+    WriteToActiveFile(file_header_);
+    active_size_ = file_header_.length();
+  }
+
+ private:
+  void ScanFinalizedFiles() {
+    bricks::FileSystem::ScanDir(directory_,
+                                [this](const std::string& file_name) {
+                                  FileLogSegment segment;
+                                  if (FileLogSegment::FromFileName(file_name, segment)) {
+                                    segments_.push_back(segment);
+                                  }
+                                });
+    std::sort(segments_.begin(),
+              segments_.end(),
+              [](const FileLogSegment& lhs, const FileLogSegment& rhs) {
+                return lhs.first_index < rhs.first_index;
+              });
+    for (const FileLogSegment& segment : segments_) {
+      if (segment.first_index != next_index_) {
+        throw StorageException("Finalized files in `" + directory_ + "` are missing entries from index " +
+                               std::to_string(next_index_) + ".");
+      }
+      next_index_ = segment.last_index + 1;
+    }
+  }
+
+  void RecoverActiveFile() {
+    active_size_ = 0;
+    if (!std::ifstream(active_file_name_)) {
+      return;  // No active file yet.
+    }
+    {
+      const MappedFile file(active_file_name_);
+      FileLogReader reader(file);
+      if (reader.ReadHeader(type_signature_)) {
+        FileLogRecordHeader header;
+        const char* payload;
+        // An incomplete or corrupted record can only be the result of the process having died while writing it,
+        // and nothing after it can be trusted. Thanks to the checksums, it can be told apart reliably.
+        while (reader.Next(header, payload) == FileLogReader::Status::Record) {
+          if (header.index != next_index_) {
+            throw StorageException("Found entry " + std::to_string(header.index) + " instead of " +
+                                   std::to_string(next_index_) + " in `" + active_file_name_ + "`.");
+          }
+          AccountForRecord(FileLogRecordHeader::kSize + header.payload_length, header.order_key);
+          ++next_index_;
+        }
+        active_size_ = reader.Offset();
+      }
+    }
+    if (active_size_ != bricks::FileSystem::GetFileSize(active_file_name_)) {
+      if (::truncate(active_file_name_.c_str(), static_cast<off_t>(active_size_))) {
+        throw StorageException("Can not truncate `" + active_file_name_ + "`.");
+      }
+    }
+  }
+
+  void CheckNextIndex(uint64_t index) const {
+    if (index != next_index_) {
+      throw StorageException("Appending entry " + std::to_string(index) + " instead of " +
+                             std::to_string(next_index_) + " to `" + directory_ + "`.");
+    }
+  }
+
+  // If writing fails, the log is rolled back to where it was before any of the records were appended,
+  // for the next append to pick up from there. Thus, the records are appended all or none.
+  void AppendRecords(const std::vector<std::string>& records, const std::vector<uint64_t>& order_keys) {
+    const ActiveFileState before = SaveActiveFileState();
+    try {
+      std::string pending;
+      for (size_t i = 0; i < records.size(); ++i) {
+        if (active_entries_ && ActiveFileIsFullFor(records[i].length(), order_keys[i])) {
+          WriteToActiveFile(pending);
+          pending.clear();
+          Finalize();
+        }
+        pending += records[i];
+        AccountForRecord(records[i].length(), order_keys[i]);
+        appended_bytes_ += records[i].length();
+        ++next_index_;
+      }
+      WriteToActiveFile(pending);
+    } catch (...) {
+      RestoreActiveFileState(before);
+      throw;
+    }
+  }
+
+  // What is known about the active file, for `AppendRecords()` to go back to.
+  struct ActiveFileState {
+    size_t segments;
+    uint64_t next_index;
+    uint64_t active_entries;
+    uint64_t active_size;
+    uint64_t active_first_order_key;
+    uint64_t active_last_order_key;
+    uint64_t appended_bytes;
+  };
+
+  ActiveFileState SaveActiveFileState() const {
+    return ActiveFileState{segments_.size(),
+                           next_index_,
+                           active_entries_,
+                           active_size_,
+                           active_first_order_key_,
+                           active_last_order_key_,
+                           appended_bytes_};
+  }
+
+  // The files finalized since are made active again: the first of them is the file the records were
+  // appended to, and the ones after it only contain the records appended, so they are removed.
+  void RestoreActiveFileState(const ActiveFileState& state) {
+    active_.close();
+    active_.clear();
+    while (segments_.size() > state.segments) {
+      const std::string file_name = bricks::FileSystem::JoinPath(directory_, segments_.back().FileName());
+      if (segments_.size() == state.segments + 1) {
+        bricks::FileSystem::RenameFile(file_name, active_file_name_);
+      } else {
+        bricks::FileSystem::RmFile(file_name);
+      }
+      segments_.pop_back();
+    }
+    next_index_ = state.next_index;
+    active_entries_ = state.active_entries;
+    active_size_ = state.active_size;
+    active_first_order_key_ = state.active_first_order_key;
+    active_last_order_key_ = state.active_last_order_key;
+    appended_bytes_ = state.appended_bytes;
+    if (::truncate(active_file_name_.c_str(), static_cast<off_t>(active_size_))) {
+      throw StorageException("Can not truncate `" + active_file_name_ + "`.");
+    }
+    active_.open(active_file_name_, std::ios::binary | std::ios::app);
+    if (!active_) {
+      throw StorageException("Can not open `" + active_file_name_ + "` for writing.");
+    }
+  }
+
+  void WriteToActiveFile(const std::string& data) {
+    active_.write(data.data(), data.length());
+    active_.flush();
+    if (!active_) {
+      throw StorageException("Failed to write to `" + active_file_name_ + "`.");
+    }
+  }
+
+  bool ActiveFileIsFullFor(size_t record_length, uint64_t order_key) const {
+    return active_entries_ >= policy_.max_entries_per_file ||
+           active_size_ + record_length > policy_.max_file_size ||
+           (order_keys_are_timestamps_ && order_key > active_first_order_key_ &&
+            order_key - active_first_order_key_ > policy_.max_file_time_window);
+  }
+
+  void AccountForRecord(size_t record_length, uint64_t order_key) {
+    if (!active_entries_) {
+      active_first_order_key_ = order_key;
+    }
+    active_last_order_key_ = order_key;
+    ++active_entries_;
+    active_size_ += record_length;
+  }
+
+  const std::string directory_;
+  const std::string active_file_name_;
+  const FileLogPolicy policy_;
+  const std::string file_header_;
+  const std::string type_signature_;
+  const bool order_keys_are_timestamps_;
+
+  std::vector<FileLogSegment> segments_;
+  std::ofstream active_;
+
+  uint64_t next_index_ = 0;
+  uint64_t active_entries_ = 0;
+  uint64_t active_size_ = 0;
+  uint64_t active_first_order_key_ = 0;
+  uint64_t active_last_order_key_ = 0;
+  uint64_t appended_bytes_ = 0;
+
+  FileLog() = delete;
+  FileLog(const FileLog&) = delete;
+  FileLog(FileLog&&) = delete;
+  void operator=(const FileLog&) = delete;
+  void operator=(FileLog&&) = delete;
+};
+
+}  // namespace storage
+}  // namespace sherlock
+
+#endif  // SHERLOCK_STORAGE_FILE_H
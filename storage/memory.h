@@ -0,0 +1,215 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// The in-memory storage for the entries of Sherlock streams.
+//
+// Entries are kept in fixed-size blocks, which are allocated as the stream grows and are never reallocated.
+// Compared to `std::vector<>`, this guarantees that:
+// 1) Appending an entry is O(1) in the worst case: no entries are ever copied or moved.
+// 2) Once added, an entry never changes its address, so references to it remain valid while the storage lives.
+//
+// Blocks are addressed via a directory of "superblocks": the k-th superblock holds pointers to 2^k blocks.
+// Superblocks are allocated as needed and never reallocated either, thus 64 of them cover all possible indexes.
+//
+// The log is designed for one writer and any number of concurrent readers, none of which take any locks.
+// The writer constructs the entry in its pre-allocated slot and then release-stores the new size,
+// which serves as the commit index: readers may access all the entries below the size they have observed.
+//
+// To bound the memory used, the writer can release the entries at the front of the log, a block at a time.
+// It is up to the user of the log to ensure no reader accesses the entries that have been released.
+
+#ifndef SHERLOCK_STORAGE_MEMORY_H
+#define SHERLOCK_STORAGE_MEMORY_H
+
+#include "../../Bricks/port.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace sherlock {
+namespace storage {
+
+inline size_t FloorLog2(uint64_t x) {
+  assert(x);
+#if defined(__GNUC__) || defined(__clang__)
+  return static_cast<size_t>(63 - __builtin_clzll(x));
+#else
+  size_t result = 0;
+  while (x >>= 1) {
+    ++result;
+  }
+  return result;
+#endif
+}
+
+template <typename T, size_t BLOCK_SIZE_LOG2 = 12>
+class InMemoryLog final {
+ public:
+  static constexpr size_t kBlockSize = static_cast<size_t>(1) << BLOCK_SIZE_LOG2;
+
+  InMemoryLog() : size_(0u), staged_(0u), allocated_blocks_(0u), released_blocks_(0u) {
+    for (auto& superblock : directory_) {
+      superblock = nullptr;
+    }
+  }
+
+  ~InMemoryLog() {
+    const size_t size = size_.load(std::memory_order_relaxed) + staged_;
+    for (size_t i = released_size(); i < size; ++i) {
+      Slot(i)->~T();
+    }
+    for (size_t b = released_blocks_; b < allocated_blocks_; ++b) {
+      delete BlockPointer(b);
+    }
+    for (auto& superblock : directory_) {
+      delete[] superblock;
+    }
+  }
+
+  // The number of committed entries. Safe to call from any thread.
+  size_t size() const { return size_.load(std::memory_order_acquire); }
+  bool empty() const { return !size(); }
+
+  // Safe to call from any thread, as long as `index` is below the value `size()` has returned.
+  const T& operator[](size_t index) const {
+    assert(index < size());
+    return *Slot(index);
+  }
+
+  // Must only be called from the writer thread.
+  template <typename... ARGS>
+  void emplace_back(ARGS&&... args) {
+    stage_back(std::forward<ARGS>(args)...);
+    commit_staged();
+  }
+
+  // The two-phase version of `emplace_back()`, for the writer to do more work on the entries, ex. persist them,
+  // before they become visible to the readers. Any number of entries can be staged, to then be committed
+  // all at once, with one store, or to be discarded all together. Must only be called from the writer thread.
+  template <typename... ARGS>
+  const T& stage_back(ARGS&&... args) {
+    const size_t index = size_.load(std::memory_order_relaxed) + staged_;
+    if (!BlockAllocated(index >> BLOCK_SIZE_LOG2)) {
+      AllocateBlock(index >> BLOCK_SIZE_LOG2);
+    }
+    new (Slot(index)) T(std::forward<ARGS>(args)...);
+    ++staged_;
+    return *Slot(index);
+  }
+
+  size_t staged_size() const { return staged_; }
+
+  // The `i`-th of the staged entries. Must only be called from the writer thread.
+  const T& staged(size_t i) const {
+    assert(i < staged_);
+    return *Slot(size_.load(std::memory_order_relaxed) + i);
+  }
+
+  void commit_staged() {
+    size_.store(size_.load(std::memory_order_relaxed) + staged_, std::memory_order_release);
+    staged_ = 0u;
+  }
+
+  void discard_staged() {
+    const size_t size = size_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < staged_; ++i) {
+      Slot(size + i)->~T();
+    }
+    staged_ = 0u;
+  }
+
+  // Destroys the entries in the blocks that are entirely below `index`, and frees these blocks.
+  // Must only be called from the writer thread, with `index` not above `size()`.
+  void release_front(size_t index) {
+    assert(index <= size());
+    const size_t blocks = index >> BLOCK_SIZE_LOG2;
+    for (; released_blocks_ < blocks; ++released_blocks_) {
+      const size_t b = released_blocks_;
+      for (size_t i = b * kBlockSize; i < (b + 1) * kBlockSize; ++i) {
+        Slot(i)->~T();
+      }
+      delete BlockPointer(b);
+      // The `k`-th superblock, of blocks from `2^k - 1` to `2^(k+1) - 2`, is freed along with its last block.
+      const size_t k = FloorLog2(b + 1);
+      if (b + 2 == static_cast<size_t>(2) << k) {
+        delete[] directory_[k];
+        directory_[k] = nullptr;
+      }
+    }
+  }
+
+  // The number of entries released so far. The ones from this index on are accessible.
+  size_t released_size() const { return released_blocks_ << BLOCK_SIZE_LOG2; }
+
+  void push_back(const T& entry) { emplace_back(entry); }
+  void push_back(T&& entry) { emplace_back(std::move(entry)); }
+
+ private:
+  struct Block {
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type entries[kBlockSize];
+  };
+
+  // The `b`-th block is the `(b + 1 - 2^k)`-th one in the `k`-th superblock, where `k = floor(log2(b + 1))`.
+  Block*& BlockPointer(size_t b) const {
+    const size_t k = FloorLog2(b + 1);
+    return directory_[k][(b + 1) - (static_cast<size_t>(1) << k)];
+  }
+
+  T* Slot(size_t index) const {
+    return reinterpret_cast<T*>(&BlockPointer(index >> BLOCK_SIZE_LOG2)->entries[index & (kBlockSize - 1)]);
+  }
+
+  // Blocks are allocated in order. A discarded entry may leave a block allocated, but not committed into.
+  bool BlockAllocated(size_t b) const { return b < allocated_blocks_; }
+
+  void AllocateBlock(size_t b) {
+    const size_t k = FloorLog2(b + 1);
+    if (!directory_[k]) {
+      // Uninitialized: only the pointers to the blocks that have been allocated are ever read.
+      directory_[k] = new Block* [static_cast<size_t>(1) << k];
+    }
+    directory_[k][(b + 1) - (static_cast<size_t>(1) << k)] = new Block;
+    ++allocated_blocks_;
+  }
+
+  std::atomic_size_t size_;
+  size_t staged_;
+  size_t allocated_blocks_;
+  size_t released_blocks_;
+  mutable Block** directory_[64];
+
+  InMemoryLog(const InMemoryLog&) = delete;
+  InMemoryLog(InMemoryLog&&) = delete;
+  void operator=(const InMemoryLog&) = delete;
+  void operator=(InMemoryLog&&) = delete;
+};
+
+}  // namespace storage
+}  // namespace sherlock
+
+#endif  // SHERLOCK_STORAGE_MEMORY_H
@@ -0,0 +1,498 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+#include "arena.h"
+#include "crc32.h"
+#include "file.h"
+#include "memory.h"
+#include "testing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/resource.h>
+
+#include "../../Bricks/file/file.h"
+#include "../../Bricks/dflags/dflags.h"
+#include "../../Bricks/3party/gtest/gtest-main-with-dflags.h"
+
+DEFINE_string(sherlock_storage_test_tmpdir, ".noshit", "Local path for the test to create temporary files in.");
+
+using sherlock::storage::Arena;
+using sherlock::storage::InMemoryLog;
+using sherlock::storage::FileLog;
+using sherlock::storage::FileLogPolicy;
+using sherlock::storage::FileLogSegment;
+using sherlock::storage::FinalizedFilesReader;
+using sherlock::storage::CleanTestDirectory;
+using bricks::FileSystem;
+
+TEST(InMemoryLog, EntriesNeverMove) {
+  // Four entries per block, to have the storage span over many blocks and superblocks.
+  InMemoryLog<std::string, 2> log;
+  EXPECT_TRUE(log.empty());
+  std::vector<const std::string*> addresses;
+  for (int i = 0; i < 10000; ++i) {
+    log.emplace_back(std::to_string(i));
+    addresses.push_back(&log[i]);
+  }
+  EXPECT_FALSE(log.empty());
+  ASSERT_EQ(10000u, log.size());
+  for (size_t i = 0; i < log.size(); ++i) {
+    EXPECT_EQ(std::to_string(i), log[i]);
+    EXPECT_EQ(addresses[i], &log[i]);
+  }
+}
+
+TEST(InMemoryLog, DestroysEntries) {
+  static std::atomic_int alive(0);
+  struct Counted {
+    Counted() { ++alive; }
+    ~Counted() { --alive; }
+  };
+  {
+    InMemoryLog<std::unique_ptr<Counted>, 3> log;
+    for (int i = 0; i < 100; ++i) {
+      log.push_back(std::unique_ptr<Counted>(new Counted()));
+    }
+    EXPECT_EQ(100, alive);
+  }
+  EXPECT_EQ(0, alive);
+}
+
+TEST(InMemoryLog, ReleasesEntriesAtTheFrontBlockByBlock) {
+  static std::atomic_int alive(0);
+  struct Counted {
+    int x;
+    explicit Counted(int x) : x(x) { ++alive; }
+    ~Counted() { --alive; }
+  };
+  {
+    // Four entries per block.
+    InMemoryLog<std::unique_ptr<Counted>, 2> log;
+    for (int i = 0; i < 100; ++i) {
+      log.push_back(std::unique_ptr<Counted>(new Counted(i)));
+    }
+    log.release_front(3);
+    EXPECT_EQ(0u, log.released_size());
+    EXPECT_EQ(100, alive);
+    log.release_front(10);
+    EXPECT_EQ(8u, log.released_size());
+    EXPECT_EQ(92, alive);
+    EXPECT_EQ(8, log[8]->x);
+    log.release_front(64);
+    EXPECT_EQ(64u, log.released_size());
+    EXPECT_EQ(36, alive);
+    for (int i = 100; i < 200; ++i) {
+      log.push_back(std::unique_ptr<Counted>(new Counted(i)));
+    }
+    EXPECT_EQ(64, log[64]->x);
+    EXPECT_EQ(199, log[199]->x);
+  }
+  EXPECT_EQ(0, alive);
+}
+
+TEST(InMemoryLog, CommitsOrDiscardsStagedEntriesAllAtOnce) {
+  InMemoryLog<std::string, 2> log;
+  log.emplace_back("zero");
+  for (int i = 1; i <= 10; ++i) {
+    log.stage_back(std::to_string(i));
+  }
+  EXPECT_EQ(1u, log.size());
+  ASSERT_EQ(10u, log.staged_size());
+  EXPECT_EQ("1", log.staged(0));
+  EXPECT_EQ("10", log.staged(9));
+  log.discard_staged();
+  EXPECT_EQ(0u, log.staged_size());
+  EXPECT_EQ(1u, log.size());
+
+  log.stage_back("one");
+  log.stage_back("two");
+  log.commit_staged();
+  ASSERT_EQ(3u, log.size());
+  EXPECT_EQ("zero", log[0]);
+  EXPECT_EQ("one", log[1]);
+  EXPECT_EQ("two", log[2]);
+}
+
+TEST(InMemoryLog, ConcurrentReadersSeeAllCommittedEntries) {
+  InMemoryLog<size_t, 4> log;
+  const size_t n = 100000u;
+  std::atomic_size_t mismatches(0u);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&log, &mismatches, n]() {
+      size_t cursor = 0;
+      while (cursor < n) {
+        const size_t size = log.size();
+        while (cursor < size) {
+          if (log[cursor] != cursor * cursor) {
+            ++mismatches;
+          }
+          ++cursor;
+        }
+      }
+    });
+  }
+  for (size_t i = 0; i < n; ++i) {
+    log.emplace_back(i * i);
+  }
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(0u, mismatches);
+}
+
+struct StoredRecord {
+  int x;
+  std::string s;
+  StoredRecord(int x = 0, const std::string& s = "") : x(x), s(s) {}
+  template <typename A>
+  void serialize(A& ar) {
+    ar(CEREAL_NVP(x), CEREAL_NVP(s));
+  }
+};
+
+inline std::vector<StoredRecord> ReplayFileLog(const std::string& directory,
+                                               const FileLogPolicy& policy = FileLogPolicy()) {
+  std::vector<StoredRecord> result;
+  FileLog<StoredRecord> log(directory, policy, "StoredRecord", false);
+  FinalizedFilesReader<StoredRecord> reader(directory, log.FinalizedSegments(), "StoredRecord");
+  if (reader.Size()) {
+    reader.Read(0, reader.Size(), result);
+  }
+  log.ReplayActiveFile([&result](StoredRecord&& entry) { result.push_back(std::move(entry)); });
+  return result;
+}
+
+// Has the writes to any file past `bytes` fail, instead of killing the process, for as long as it is in scope.
+class FileSizeLimit final {
+ public:
+  explicit FileSizeLimit(rlim_t bytes) {
+    ::signal(SIGXFSZ, SIG_IGN);
+    ::getrlimit(RLIMIT_FSIZE, &saved_);
+    struct rlimit limit = saved_;
+    limit.rlim_cur = bytes;
+    ::setrlimit(RLIMIT_FSIZE, &limit);
+  }
+  ~FileSizeLimit() { ::setrlimit(RLIMIT_FSIZE, &saved_); }
+
+ private:
+  struct rlimit saved_;
+};
+
+TEST(Arena, ReusesFreedBlocksOfTheSameSize) {
+  Arena arena;
+  void* a = arena.Allocate(40);
+  void* b = arena.Allocate(40);
+  EXPECT_EQ(static_cast<char*>(a) + 48, static_cast<char*>(b));
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(a) % alignof(std::max_align_t));
+  arena.Deallocate(a, 40);
+  EXPECT_EQ(a, arena.Allocate(33));
+  void* c = arena.Allocate(8);
+  EXPECT_NE(a, c);
+  EXPECT_EQ(2u, arena.Slabs());
+  for (int i = 0; i < 10000; ++i) {
+    arena.Allocate(48);
+  }
+  EXPECT_EQ(9u, arena.Slabs());  // 1365 blocks of 48 bytes per slab.
+  void* large = arena.Allocate(Arena::kMaxPooledSize + 1);
+  EXPECT_EQ(9u, arena.Slabs());
+  arena.Deallocate(large, Arena::kMaxPooledSize + 1);
+  arena.Deallocate(b, 40);
+  arena.Deallocate(c, 8);
+}
+
+TEST(FileLog, CRC32) {
+  EXPECT_EQ(0u, sherlock::storage::CRC32("", 0));
+  EXPECT_EQ(0xcbf43926u, sherlock::storage::CRC32("123456789", 9));
+  EXPECT_EQ(0xcbf43926u, sherlock::storage::CRC32("6789", 4, sherlock::storage::CRC32("12345", 5)));
+}
+
+TEST(FileLog, SegmentFileNames) {
+  FileLogSegment segment;
+  segment.first_index = 0;
+  segment.last_index = 99;
+  segment.first_order_key = 1000;
+  segment.last_order_key = 2000;
+  EXPECT_EQ("finalized.00000000000000000000-00000000000000000099.00000000000000001000-00000000000000002000",
+            segment.FileName());
+  FileLogSegment parsed;
+  ASSERT_TRUE(FileLogSegment::FromFileName(segment.FileName(), parsed));
+  EXPECT_EQ(0u, parsed.first_index);
+  EXPECT_EQ(99u, parsed.last_index);
+  EXPECT_EQ(1000u, parsed.first_order_key);
+  EXPECT_EQ(2000u, parsed.last_order_key);
+  EXPECT_FALSE(FileLogSegment::FromFileName("active", parsed));
+  EXPECT_FALSE(FileLogSegment::FromFileName(segment.FileName() + ".tmp", parsed));
+}
+
+TEST(FileLog, FinalizesFilesAndReplaysThemInOrder) {
+  const std::string directory = CleanTestDirectory(FLAGS_sherlock_storage_test_tmpdir, "file_log_finalize");
+  FileLogPolicy policy;
+  policy.max_entries_per_file = 3;
+  {
+    FileLog<StoredRecord> log(directory, policy, "StoredRecord", false);
+    EXPECT_EQ(0u, log.Size());
+    for (int i = 0; i < 8; ++i) {
+      log.Append(StoredRecord(i, "foo"), i, 100 + i);
+    }
+    ASSERT_EQ(2u, log.FinalizedSegments().size());
+    EXPECT_EQ(0u, log.FinalizedSegments()[0].first_index);
+    EXPECT_EQ(2u, log.FinalizedSegments()[0].last_index);
+    EXPECT_EQ(100u, log.FinalizedSegments()[0].first_order_key);
+    EXPECT_EQ(102u, log.FinalizedSegments()[0].last_order_key);
+    EXPECT_EQ(3u, log.FinalizedSegments()[1].first_index);
+    EXPECT_EQ(5u, log.FinalizedSegments()[1].last_index);
+  }
+  {
+    FileLog<StoredRecord> log(directory, policy, "StoredRecord", false);
+    EXPECT_EQ(8u, log.Size());
+    log.Append(StoredRecord(8, "bar"), 8, 108);
+    EXPECT_EQ(2u, log.FinalizedSegments().size());
+    log.Append(StoredRecord(9, "bar"), 9, 109);  // The active file is full, and is finalized first.
+    ASSERT_EQ(3u, log.FinalizedSegments().size());
+    EXPECT_EQ(6u, log.FinalizedSegments()[2].first_index);
+    EXPECT_EQ(8u, log.FinalizedSegments()[2].last_index);
+  }
+  const std::vector<StoredRecord> replayed = ReplayFileLog(directory, policy);
+  ASSERT_EQ(10u, replayed.size());
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(i, replayed[i].x);
+    EXPECT_EQ(i < 8 ? "foo" : "bar", replayed[i].s);
+  }
+}
+
+TEST(FileLog, AppendsBatchesAcrossFiles) {
+  const std::string directory = CleanTestDirectory(FLAGS_sherlock_storage_test_tmpdir, "file_log_batch");
+  FileLogPolicy policy;
+  policy.max_entries_per_file = 10;
+  {
+    FileLog<StoredRecord> log(directory, policy, "StoredRecord", false);
+    log.Append(StoredRecord(0), 0, 0);
+    std::vector<StoredRecord> batch;
+    std::vector<uint64_t> order_keys;
+    for (int i = 1; i <= 24; ++i) {
+      batch.emplace_back(i);
+      order_keys.push_back(i);
+    }
+    log.AppendBatch(batch, 1, order_keys);
+    EXPECT_EQ(25u, log.Size());
+    ASSERT_EQ(2u, log.FinalizedSegments().size());
+    EXPECT_EQ(19u, log.FinalizedSegments()[1].last_index);
+    EXPECT_THROW(log.AppendBatch(batch, 1, order_keys), sherlock::storage::StorageException);
+  }
+  const std::vector<StoredRecord> replayed = ReplayFileLog(directory, policy);
+  ASSERT_EQ(25u, replayed.size());
+  for (int i = 0; i < 25; ++i) {
+    EXPECT_EQ(i, replayed[i].x);
+  }
+}
+
+TEST(FileLog, FinalizesFilesByTimeWindow) {
+  const std::string directory = CleanTestDirectory(FLAGS_sherlock_storage_test_tmpdir, "file_log_time_window");
+  FileLogPolicy policy;
+  policy.max_file_time_window = 1000;
+  FileLog<StoredRecord> log(directory, policy, "StoredRecord", true);
+  log.Append(StoredRecord(0), 0, 10000);
+  log.Append(StoredRecord(1), 1, 11000);
+  EXPECT_EQ(0u, log.FinalizedSegments().size());
+  log.Append(StoredRecord(2), 2, 11001);
+  ASSERT_EQ(1u, log.FinalizedSegments().size());
+  EXPECT_EQ(10000u, log.FinalizedSegments()[0].first_order_key);
+  EXPECT_EQ(11000u, log.FinalizedSegments()[0].last_order_key);
+}
+
+TEST(FileLog, DropsIncompleteRecordAtTheEndOfActiveFile) {
+  const std::string directory =
+      CleanTestDirectory(FLAGS_sherlock_storage_test_tmpdir, "file_log_incomplete_record");
+  const std::string active_file_name = FileSystem::JoinPath(directory, "active");
+  {
+    FileLog<StoredRecord> log(directory, FileLogPolicy(), "StoredRecord", false);
+    log.Append(StoredRecord(1), 0, 0);
+    log.Append(StoredRecord(2), 1, 1);
+  }
+  // Emulate the process having died while writing the third record.
+  const std::string record = sherlock::storage::FileLogRecord("payload", 2, 2);
+  FileSystem::WriteStringToFile(record.substr(0, record.length() - 1), active_file_name.c_str(), true);
+  {
+    FileLog<StoredRecord> log(directory, FileLogPolicy(), "StoredRecord", false);
+    EXPECT_EQ(2u, log.Size());
+    log.Append(StoredRecord(3), 2, 2);
+  }
+  const std::vector<StoredRecord> replayed = ReplayFileLog(directory);
+  ASSERT_EQ(3u, replayed.size());
+  EXPECT_EQ(1, replayed[0].x);
+  EXPECT_EQ(2, replayed[1].x);
+  EXPECT_EQ(3, replayed[2].x);
+}
+
+TEST(FileLog, RollsBackFailedAppend) {
+  const std::string directory =
+      CleanTestDirectory(FLAGS_sherlock_storage_test_tmpdir, "file_log_failed_append");
+  {
+    FileLog<StoredRecord> log(directory, FileLogPolicy(), "StoredRecord", false);
+    log.Append(StoredRecord(1), 0, 0);
+    const uint64_t active_file_size = log.ActiveFileSize();
+    {
+      const FileSizeLimit limit(active_file_size + 1000);
+      EXPECT_THROW(log.Append(StoredRecord(2, std::string(10000, 'x')), 1, 1),
+                   sherlock::storage::StorageException);
+    }
+    EXPECT_EQ(1u, log.Size());
+    EXPECT_EQ(active_file_size, log.ActiveFileSize());
+    log.Append(StoredRecord(3), 1, 1);
+  }
+  const std::vector<StoredRecord> replayed = ReplayFileLog(directory);
+  ASSERT_EQ(2u, replayed.size());
+  EXPECT_EQ(1, replayed[0].x);
+  EXPECT_EQ(3, replayed[1].x);
+}
+
+TEST(FileLog, RollsBackFailedBatchAcrossFiles) {
+  const std::string directory = CleanTestDirectory(FLAGS_sherlock_storage_test_tmpdir, "file_log_failed_batch");
+  FileLogPolicy policy;
+  policy.max_entries_per_file = 10;
+  {
+    FileLog<StoredRecord> log(directory, policy, "StoredRecord", false);
+    for (int i = 0; i < 5; ++i) {
+      log.Append(StoredRecord(i), i, i);
+    }
+    const uint64_t active_file_size = log.ActiveFileSize();
+    // The first five entries of the batch fill up the active file, which gets finalized, and the last one
+    // fails to be written to the next file.
+    std::vector<StoredRecord> batch;
+    std::vector<uint64_t> order_keys;
+    for (int i = 5; i < 20; ++i) {
+      batch.emplace_back(i, i == 19 ? std::string(10000, 'x') : "");
+      order_keys.push_back(i);
+    }
+    {
+      const FileSizeLimit limit(active_file_size * 2 + 1000);
+      EXPECT_THROW(log.AppendBatch(batch, 5, order_keys), sherlock::storage::StorageException);
+    }
+    EXPECT_EQ(5u, log.Size());
+    EXPECT_TRUE(log.FinalizedSegments().empty());
+    EXPECT_EQ(active_file_size, log.ActiveFileSize());
+    log.Append(StoredRecord(5), 5, 5);
+  }
+  const std::vector<StoredRecord> replayed = ReplayFileLog(directory, policy);
+  ASSERT_EQ(6u, replayed.size());
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(i, replayed[i].x);
+    EXPECT_EQ("", replayed[i].s);
+  }
+}
+
+TEST(FileLog, DropsCorruptedRecordsAtTheEndOfActiveFile) {
+  const std::string directory =
+      CleanTestDirectory(FLAGS_sherlock_storage_test_tmpdir, "file_log_corrupted_record");
+  const std::string active_file_name = FileSystem::JoinPath(directory, "active");
+  {
+    FileLog<StoredRecord> log(directory, FileLogPolicy(), "StoredRecord", false);
+    log.Append(StoredRecord(1, "one"), 0, 0);
+    log.Append(StoredRecord(2, "two"), 1, 1);
+    log.Append(StoredRecord(3, "three"), 2, 2);
+  }
+  // Flip one bit in the payload of the second record.
+  std::string contents = FileSystem::ReadFileAsString(active_file_name);
+  const size_t position = contents.find("two");
+  ASSERT_NE(std::string::npos, position);
+  contents[position] ^= 1;
+  FileSystem::WriteStringToFile(contents, active_file_name.c_str());
+
+  const std::vector<StoredRecord> replayed = ReplayFileLog(directory);
+  ASSERT_EQ(1u, replayed.size());
+  EXPECT_EQ("one", replayed[0].s);
+  EXPECT_GT(contents.length(), FileSystem::GetFileSize(active_file_name));
+}
+
+TEST(FileLog, RejectsFilesOfOtherTypes) {
+  const std::string directory =
+      CleanTestDirectory(FLAGS_sherlock_storage_test_tmpdir, "file_log_type_signature");
+  {
+    FileLog<StoredRecord> log(directory, FileLogPolicy(), "StoredRecord", false);
+    log.Append(StoredRecord(1), 0, 0);
+  }
+  ASSERT_THROW(FileLog<StoredRecord>(directory, FileLogPolicy(), "SomethingElse", false),
+               sherlock::storage::StorageException);
+  EXPECT_EQ(1u, ReplayFileLog(directory).size());
+}
+
+TEST(FileLog, ReadsFinalizedFilesFromAnyIndex) {
+  const std::string directory = CleanTestDirectory(FLAGS_sherlock_storage_test_tmpdir, "file_log_reader");
+  FileLogPolicy policy;
+  policy.max_entries_per_file = 10;
+  FileLog<StoredRecord> log(directory, policy, "StoredRecord", false);
+  for (int i = 0; i < 95; ++i) {
+    log.Append(StoredRecord(i), i, i);
+  }
+  ASSERT_EQ(9u, log.FinalizedSegments().size());
+
+  FinalizedFilesReader<StoredRecord> reader(directory, log.FinalizedSegments(), "StoredRecord");
+  ASSERT_EQ(90u, reader.Size());
+  std::vector<StoredRecord> entries;
+  reader.Read(15, 3, entries);  // Within one file.
+  reader.Read(18, 7, entries);  // Sequentially, across the files.
+  reader.Read(42, 48, entries);  // After a seek, until the very end.
+  reader.Read(0, 1, entries);  // Back to the beginning.
+  ASSERT_EQ(59u, entries.size());
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(15 + i, entries[i].x);
+  }
+  for (int i = 0; i < 48; ++i) {
+    EXPECT_EQ(42 + i, entries[10 + i].x);
+  }
+  EXPECT_EQ(0, entries[58].x);
+}
+
+TEST(FileLog, FindsFinalizedEntriesByOrderKey) {
+  const std::string directory = CleanTestDirectory(FLAGS_sherlock_storage_test_tmpdir, "file_log_lower_bound");
+  FileLogPolicy policy;
+  policy.max_entries_per_file = 10;
+  FileLog<StoredRecord> log(directory, policy, "StoredRecord", false);
+  // Four entries per order key, so that some of the order keys span two files.
+  for (int i = 0; i < 95; ++i) {
+    log.Append(StoredRecord(i), i, (i / 4) * 10);
+  }
+  ASSERT_EQ(9u, log.FinalizedSegments().size());
+
+  FinalizedFilesReader<StoredRecord> reader(directory, log.FinalizedSegments(), "StoredRecord");
+  for (uint64_t order_key = 0; order_key <= 250; ++order_key) {
+    EXPECT_EQ(std::min(90u, static_cast<unsigned>(4 * ((order_key + 9) / 10))), reader.LowerBound(order_key))
+        << order_key;
+  }
+
+  // The reader is positioned at the found entry.
+  std::vector<StoredRecord> entries;
+  ASSERT_EQ(28u, reader.LowerBound(70));
+  reader.Read(28, 3, entries);
+  ASSERT_EQ(3u, entries.size());
+  EXPECT_EQ(28, entries[0].x);
+  EXPECT_EQ(30, entries[2].x);
+}
@@ -0,0 +1,51 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// The helpers shared by the tests of the persistent streams.
+
+#ifndef SHERLOCK_STORAGE_TESTING_H
+#define SHERLOCK_STORAGE_TESTING_H
+
+#include <string>
+
+#include "../../Bricks/file/file.h"
+
+namespace sherlock {
+namespace storage {
+
+// Creates the `name` directory in `tmpdir` if it does not exist, and removes all the files from it.
+inline std::string CleanTestDirectory(const std::string& tmpdir, const std::string& name) {
+  const std::string directory = bricks::FileSystem::JoinPath(tmpdir, name);
+  bricks::FileSystem::MkDir(directory, bricks::FileSystem::MkDirParameters::Silent);
+  bricks::FileSystem::ScanDir(directory,
+                              [&directory](const std::string& file_name) {
+                                bricks::FileSystem::RmFile(bricks::FileSystem::JoinPath(directory, file_name));
+                              });
+  return directory;
+}
+
+}  // namespace storage
+}  // namespace sherlock
+
+#endif  // SHERLOCK_STORAGE_TESTING_H
@@ -26,11 +26,16 @@ SOFTWARE.
 #define BRICKS_MOCK_TIME
 
 #include "sherlock.h"
+#include "storage/testing.h"
 
+#include <algorithm>
 #include <string>
 #include <atomic>
 #include <thread>
+#include <mutex>
+#include <vector>
 
+#include "../Bricks/file/file.h"
 #include "../Bricks/strings/util.h"
 #include "../Bricks/cerealize/cerealize.h"
 #include "../Bricks/net/api/api.h"
@@ -40,6 +45,7 @@ SOFTWARE.
 #include "../Bricks/3party/gtest/gtest-main-with-dflags.h"
 
 DEFINE_int32(sherlock_http_test_port, 8090, "Local port to use for Sherlock unit test.");
+DEFINE_string(sherlock_test_tmpdir, ".noshit", "Local path for the test to create temporary files in.");
 
 using std::string;
 using std::atomic_bool;
@@ -54,6 +60,8 @@ using bricks::strings::ToString;
 using bricks::time::EPOCH_MILLISECONDS;
 using bricks::time::MILLISECONDS_INTERVAL;
 
+using sherlock::storage::CleanTestDirectory;
+
 // The records we work with.
 // TODO(dkorolev): Support and test polymorphic types.
 struct Record {
@@ -152,6 +160,38 @@ TEST(Sherlock, SubscribeAndProcessThreeEntries) {
       << d.results_;
 }
 
+TEST(Sherlock, SubscribeFromIndex) {
+  auto from_stream = sherlock::Stream<Record>("from");
+  from_stream.Publish(1);
+  from_stream.Publish(2);
+  from_stream.Publish(3);
+
+  struct Collector {
+    string results_;
+    const size_t last_index_;
+    explicit Collector(size_t last_index) : last_index_(last_index) {}
+    bool Entry(const Record& entry, size_t index, size_t) {
+      results_ += Printf("%s%d:%d", results_.empty() ? "" : ",", int(index), entry.x_);
+      return index < last_index_;
+    }
+    bool Terminate() { return false; }
+  };
+
+  Collector collector(2u);
+  from_stream.SyncSubscribe(collector, 1u).Join();
+  EXPECT_EQ("1:2,2:3", collector.results_);
+
+  // Subscribing beyond the end of the stream waits for the entries to be published.
+  Collector waiting_collector(4u);
+  {
+    auto scope = from_stream.SyncSubscribe(waiting_collector, 4u);
+    from_stream.Publish(4);
+    from_stream.Publish(5);
+    scope.Join();
+  }
+  EXPECT_EQ("4:5", waiting_collector.results_);
+}
+
 TEST(Sherlock, SubscribeAndProcessThreeEntriesByUniquePtr) {
   auto bar_stream = sherlock::Stream<Record>("bar");
   bar_stream.Publish(4);
@@ -175,7 +215,7 @@ TEST(Sherlock, SubscribeAndProcessThreeEntriesByUniquePtr) {
 }
 
 TEST(Sherlock, AsyncSubscribeAndProcessThreeEntriesByUniquePtr) {
-  auto bar_stream = sherlock::Stream<Record>("bar");
+  auto bar_stream = sherlock::Stream<Record>("async_bar");
   bar_stream.Publish(4);
   bar_stream.Publish(5);
   bar_stream.Publish(6);
@@ -311,6 +351,17 @@ TEST(Sherlock, SubscribeToStreamViaHTTP) {
             HTTP(GET(Printf("http://localhost:%d/exposed?cap=2", FLAGS_sherlock_http_test_port))).body);
   EXPECT_EQ(s[0], HTTP(GET(Printf("http://localhost:%d/exposed?cap=1", FLAGS_sherlock_http_test_port))).body);
 
+  // Test `?from=...`, alone and combined with `?n=...` and `?cap=...`.
+  EXPECT_EQ(s[2] + s[3],
+            HTTP(GET(Printf("http://localhost:%d/exposed?from=2&cap=2", FLAGS_sherlock_http_test_port))).body);
+  EXPECT_EQ(s[1],
+            HTTP(GET(Printf("http://localhost:%d/exposed?from=1&cap=1", FLAGS_sherlock_http_test_port))).body);
+  EXPECT_EQ(s[2] + s[3],
+            HTTP(GET(Printf("http://localhost:%d/exposed?from=1&n=2", FLAGS_sherlock_http_test_port))).body);
+  EXPECT_EQ(
+      s[3],
+      HTTP(GET(Printf("http://localhost:%d/exposed?from=3&n=2&cap=1", FLAGS_sherlock_http_test_port))).body);
+
   // Test `?recent=...`, have to use `?cap=...`.
   EXPECT_EQ(
       s[3],
@@ -346,3 +397,1013 @@ TEST(Sherlock, SubscribeToStreamViaHTTP) {
   // TODO(dkorolev): Unregister the exposed endpoint and free its handler. It's hanging out there now...
   // TODO(dkorolev): Add tests that the endpoint is not unregistered until its last client is done. (?)
 }
+
+TEST(Sherlock, SubscribeToStreamViaHTTPOnPool) {
+  auto pooled_exposed_stream = sherlock::Stream<RecordWithTimestamp>("pooled_exposed");
+  pooled_exposed_stream.Emplace("one", EPOCH_MILLISECONDS(1000));
+  pooled_exposed_stream.Emplace("two", EPOCH_MILLISECONDS(2000));
+
+  sherlock::scheduler::WorkerPool pool(1);
+  pooled_exposed_stream.ServeHTTPSubscribersOn(pool);
+  HTTP(FLAGS_sherlock_http_test_port).ResetAllHandlers();
+  HTTP(FLAGS_sherlock_http_test_port).Register("/pooled_exposed", pooled_exposed_stream);
+
+  EXPECT_EQ(JSON(RecordWithTimestamp("two", EPOCH_MILLISECONDS(2000)), "entry") + '\n',
+            HTTP(GET(Printf("http://localhost:%d/pooled_exposed?n=1", FLAGS_sherlock_http_test_port))).body);
+  EXPECT_EQ(JSON(RecordWithTimestamp("one", EPOCH_MILLISECONDS(1000)), "entry") + '\n',
+            HTTP(GET(Printf("http://localhost:%d/pooled_exposed?cap=1", FLAGS_sherlock_http_test_port))).body);
+
+  // The pool does not outlive this test, and neither should the endpoint that uses it.
+  HTTP(FLAGS_sherlock_http_test_port).ResetAllHandlers();
+}
+
+TEST(Sherlock, SubscribeToStreamViaHTTPInBinaryFormat) {
+  auto binary_exposed_stream = sherlock::Stream<RecordWithTimestamp>("binary_exposed");
+  binary_exposed_stream.Emplace("one", EPOCH_MILLISECONDS(1000));
+  binary_exposed_stream.Emplace("two", EPOCH_MILLISECONDS(2000));
+  binary_exposed_stream.Emplace("three", EPOCH_MILLISECONDS(3000));
+
+  HTTP(FLAGS_sherlock_http_test_port).ResetAllHandlers();
+  HTTP(FLAGS_sherlock_http_test_port).Register("/binary_exposed", binary_exposed_stream);
+  const std::string body =
+      HTTP(GET(Printf("http://localhost:%d/binary_exposed?from=1&format=binary&nowait",
+                      FLAGS_sherlock_http_test_port))).body;
+  EXPECT_EQ(sherlock::BinaryEntry(RecordWithTimestamp("two", EPOCH_MILLISECONDS(2000))) +
+                sherlock::BinaryEntry(RecordWithTimestamp("three", EPOCH_MILLISECONDS(3000))),
+            body);
+
+  // The entries are parsed back as the response comes, regardless of how it is split into chunks.
+  std::vector<std::string> results;
+  const auto collect = [&results](RecordWithTimestamp&& entry) {
+    results.push_back(Printf("%s@%d", entry.s_.c_str(), static_cast<int>(entry.timestamp_)));
+  };
+  sherlock::BinaryEntriesReader<RecordWithTimestamp> reader;
+  for (size_t i = 0; i + 1 < body.length(); ++i) {
+    reader.Feed(&body[i], 1u, collect);
+  }
+  ASSERT_EQ(1u, results.size());
+  EXPECT_EQ("two@2000", results[0]);
+  const size_t first_entry_length =
+      sherlock::BinaryEntry(RecordWithTimestamp("two", EPOCH_MILLISECONDS(2000))).length();
+  EXPECT_EQ(body.length() - 1u - first_entry_length, reader.Incomplete());
+  reader.Feed(&body.back(), 1u, collect);
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ("three@3000", results[1]);
+  EXPECT_EQ(0u, reader.Incomplete());
+}
+
+TEST(Sherlock, SubscribeToStreamViaHTTPReplaysManyEntriesInLargeChunks) {
+  auto replayed_stream = sherlock::Stream<RecordWithTimestamp>("replayed");
+  std::string expected;
+  for (int i = 0; i < 10000; ++i) {
+    replayed_stream.Emplace(ToString(i), EPOCH_MILLISECONDS(i));
+    expected += JSON(RecordWithTimestamp(ToString(i), EPOCH_MILLISECONDS(i)), "entry") + '\n';
+  }
+  ASSERT_GT(expected.length(), 4u * 64u * 1024u);
+  HTTP(FLAGS_sherlock_http_test_port).ResetAllHandlers();
+  HTTP(FLAGS_sherlock_http_test_port).Register("/replayed", replayed_stream);
+  EXPECT_EQ(expected,
+            HTTP(GET(Printf("http://localhost:%d/replayed?nowait", FLAGS_sherlock_http_test_port))).body);
+  EXPECT_EQ(JSON(RecordWithTimestamp("9999", EPOCH_MILLISECONDS(9999)), "entry") + '\n',
+            HTTP(GET(Printf("http://localhost:%d/replayed?n=1", FLAGS_sherlock_http_test_port))).body);
+}
+
+TEST(Sherlock, HTTPSubscribersShareEncodedEntries) {
+  using sherlock::EncodedEntriesCache;
+  EncodedEntriesCache cache;
+  size_t encoded = 0u;
+  const auto encode = [&encoded]() { return ToString(++encoded); };
+  const auto first = cache.Get(EncodedEntriesCache::Format::JSON, 42u, encode);
+  EXPECT_EQ("1", *first);
+  EXPECT_EQ(first, cache.Get(EncodedEntriesCache::Format::JSON, 42u, encode));
+  EXPECT_EQ(1u, encoded);
+  // Each format is cached on its own.
+  EXPECT_EQ("2", *cache.Get(EncodedEntriesCache::Format::Binary, 42u, encode));
+  // Only the most recent entries are kept.
+  const size_t evicting_index = 42u + EncodedEntriesCache::kSlotsPerFormat;
+  EXPECT_EQ("3", *cache.Get(EncodedEntriesCache::Format::JSON, evicting_index, encode));
+  EXPECT_EQ("4", *cache.Get(EncodedEntriesCache::Format::JSON, 42u, encode));
+  EXPECT_EQ("1", *first);
+
+  // The subscribers sharing the encoded entries get the same output as they would otherwise.
+  auto shared_stream = sherlock::Stream<RecordWithTimestamp>("shared_encoded");
+  shared_stream.Emplace("one", EPOCH_MILLISECONDS(1000));
+  shared_stream.Emplace("two", EPOCH_MILLISECONDS(2000));
+  HTTP(FLAGS_sherlock_http_test_port).ResetAllHandlers();
+  HTTP(FLAGS_sherlock_http_test_port).Register("/shared_encoded", shared_stream);
+  const std::string expected = JSON(RecordWithTimestamp("one", EPOCH_MILLISECONDS(1000)), "entry") + '\n' +
+                               JSON(RecordWithTimestamp("two", EPOCH_MILLISECONDS(2000)), "entry") + '\n';
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(
+        expected,
+        HTTP(GET(Printf("http://localhost:%d/shared_encoded?cap=2", FLAGS_sherlock_http_test_port))).body);
+  }
+  EXPECT_EQ(sherlock::BinaryEntry(RecordWithTimestamp("two", EPOCH_MILLISECONDS(2000))),
+            HTTP(GET(Printf("http://localhost:%d/shared_encoded?from=1&nowait&format=binary",
+                            FLAGS_sherlock_http_test_port))).body);
+}
+
+// Entries that count how many times they have been copied, to test that listeners get no unnecessary copies.
+struct CopyCountingRecord {
+  static atomic_size_t copies;
+  int x_;
+  CopyCountingRecord(int x = 0) : x_(x) {}
+  CopyCountingRecord(const CopyCountingRecord& rhs) : x_(rhs.x_) { ++copies; }
+  CopyCountingRecord(CopyCountingRecord&& rhs) noexcept : x_(rhs.x_) {}
+  CopyCountingRecord& operator=(const CopyCountingRecord& rhs) {
+    x_ = rhs.x_;
+    ++copies;
+    return *this;
+  }
+  CopyCountingRecord& operator=(CopyCountingRecord&& rhs) noexcept {
+    x_ = rhs.x_;
+    return *this;
+  }
+};
+atomic_size_t CopyCountingRecord::copies(0u);
+
+TEST(Sherlock, ConstReferenceListenersGetNoCopies) {
+  auto copies_stream = sherlock::Stream<CopyCountingRecord>("copies");
+  copies_stream.Emplace(1);
+  copies_stream.Emplace(2);
+  copies_stream.Emplace(3);
+  CopyCountingRecord::copies = 0u;
+
+  struct ConstReferenceListener {
+    string results_;
+    bool Entry(const CopyCountingRecord& entry, size_t index, size_t total) {
+      static_cast<void>(total);
+      results_ += ToString(entry.x_);
+      return index < 2u;
+    }
+    bool Terminate() { return false; }  // Make `Join()` wait until all three entries are processed.
+  };
+  ConstReferenceListener const_reference_listener;
+  copies_stream.SyncSubscribe(const_reference_listener).Join();
+  EXPECT_EQ("123", const_reference_listener.results_);
+  EXPECT_EQ(0u, CopyCountingRecord::copies);
+
+  struct MutableReferenceListener {
+    string results_;
+    bool Entry(CopyCountingRecord& entry, size_t index, size_t total) {
+      static_cast<void>(total);
+      results_ += ToString(entry.x_);
+      entry.x_ = -1;  // Must not affect the entry stored in the stream.
+      return index < 2u;
+    }
+    bool Terminate() { return false; }
+  };
+  MutableReferenceListener mutable_reference_listener;
+  copies_stream.SyncSubscribe(mutable_reference_listener).Join();
+  EXPECT_EQ("123", mutable_reference_listener.results_);
+  EXPECT_EQ(3u, CopyCountingRecord::copies);  // One copy per entry, made by the copy constructor.
+
+  ConstReferenceListener another_const_reference_listener;
+  copies_stream.SyncSubscribe(another_const_reference_listener).Join();
+  EXPECT_EQ("123", another_const_reference_listener.results_);
+}
+
+// Polymorphic entries providing the `Clone()` method are cloned with it.
+struct Shape {
+  virtual ~Shape() = default;
+  virtual std::string Name() const = 0;
+  virtual Shape* Clone() const = 0;
+};
+
+struct Circle : Shape {
+  int r_;
+  explicit Circle(int r) : r_(r) {}
+  std::string Name() const override { return Printf("circle(%d)", r_); }
+  Shape* Clone() const override { return new Circle(*this); }
+};
+
+struct Square : Shape {
+  int a_;
+  explicit Square(int a) : a_(a) {}
+  std::string Name() const override { return Printf("square(%d)", a_); }
+  Shape* Clone() const override { return new Square(*this); }
+};
+
+TEST(Sherlock, PolymorphicEntriesAreClonedViaCloneMethod) {
+  auto shapes_stream = sherlock::Stream<std::unique_ptr<Shape>>("shapes");
+  shapes_stream.Publish(Circle(1));
+  shapes_stream.Publish(Square(2));
+
+  struct ShapesCollector {
+    std::vector<std::unique_ptr<Shape>> shapes_;
+    bool Entry(std::unique_ptr<Shape>& entry, size_t index, size_t total) {
+      static_cast<void>(total);
+      shapes_.push_back(std::move(entry));  // The listener owns its copy.
+      return index < 1u;
+    }
+    bool Terminate() { return false; }
+  };
+  ShapesCollector collector;
+  shapes_stream.SyncSubscribe(collector).Join();
+  ASSERT_EQ(2u, collector.shapes_.size());
+  EXPECT_EQ("circle(1)", collector.shapes_[0]->Name());
+  EXPECT_EQ("square(2)", collector.shapes_[1]->Name());
+
+  ShapesCollector another_collector;
+  shapes_stream.SyncSubscribe(another_collector).Join();
+  ASSERT_EQ(2u, another_collector.shapes_.size());
+  EXPECT_EQ("circle(1)", another_collector.shapes_[0]->Name());
+  EXPECT_EQ("square(2)", another_collector.shapes_[1]->Name());
+}
+
+// Polymorphic entries can be moved or constructed right into the stream, without copies.
+// Deriving their base class from `ArenaAllocated<>` has them allocated from the arena.
+struct Message : sherlock::storage::ArenaAllocated<Message> {
+  virtual ~Message() = default;
+  virtual std::string Text() const = 0;
+};
+
+struct TextMessage : Message {
+  std::string text_;
+  explicit TextMessage(std::string text) : text_(std::move(text)) {}
+  TextMessage(TextMessage&&) = default;
+  TextMessage(const TextMessage&) = delete;
+  std::string Text() const override { return text_; }
+};
+
+TEST(Sherlock, PolymorphicEntriesAreMovedOrEmplacedIntoArena) {
+  auto messages_stream = sherlock::Stream<std::unique_ptr<Message>>("messages");
+  EXPECT_EQ(0u, messages_stream.Publish(TextMessage("moved")));
+  EXPECT_EQ(1u, messages_stream.EmplacePolymorphic<TextMessage>("emplaced"));
+  for (int i = 2; i < 1000; ++i) {
+    messages_stream.EmplacePolymorphic<TextMessage>(std::to_string(i));
+  }
+  // A thousand small entries fit into a single slab.
+  EXPECT_EQ(1u, Message::GetArena().Slabs());
+
+  struct MessagesCollector {
+    std::vector<std::string> texts_;
+    bool Entry(const std::unique_ptr<Message>& entry, size_t index, size_t total) {
+      static_cast<void>(total);
+      texts_.push_back(entry->Text());
+      return index < 2u;
+    }
+    bool Terminate() { return false; }
+  };
+  MessagesCollector collector;
+  messages_stream.SyncSubscribe(collector).Join();
+  EXPECT_EQ((std::vector<std::string>{"moved", "emplaced", "2"}), collector.texts_);
+}
+
+TEST(Sherlock, BatchListenersGetAllAvailableEntriesAtOnce) {
+  auto batch_stream = sherlock::Stream<Record>("batch");
+  for (int i = 0; i < 1000; ++i) {
+    batch_stream.Publish(i);
+  }
+
+  struct BatchListener {
+    atomic_size_t seen_;
+    std::vector<size_t> batch_sizes_;
+    string errors_;
+    BatchListener() : seen_(0u) {}
+    bool EntryBatch(const sherlock::EntriesRange<Record>& entries, size_t first_index, size_t total) {
+      if (first_index != seen_ || first_index + entries.size() != total) {
+        errors_ += Printf("Bad range [%d, %d).\n", int(first_index), int(total));
+      }
+      size_t index = first_index;
+      for (const Record& entry : entries) {
+        if (entry.x_ != static_cast<int>(index++)) {
+          errors_ += Printf("Bad entry %d.\n", entry.x_);
+        }
+      }
+      batch_sizes_.push_back(entries.size());
+      seen_ += entries.size();
+      return seen_ < 1003u;
+    }
+    bool Terminate() { return false; }
+  };
+
+  BatchListener listener;
+  auto scope = batch_stream.SyncSubscribe(listener);
+  while (listener.seen_ < 1000u) {
+    ;  // Spin lock.
+  }
+  batch_stream.Publish(1000);
+  batch_stream.Publish(1001);
+  batch_stream.Publish(1002);
+  scope.Join();
+  EXPECT_EQ("", listener.errors_);
+  EXPECT_EQ(1003u, listener.seen_);
+  ASSERT_LE(2u, listener.batch_sizes_.size());
+  EXPECT_EQ(1000u, listener.batch_sizes_[0]);  // The whole history is passed in one batch.
+}
+
+TEST(Sherlock, PublishBatchMakesEntriesVisibleAllAtOnce) {
+  auto published_in_batches = sherlock::Stream<Record>("published_in_batches");
+  EXPECT_EQ(0u, published_in_batches.Publish(0));
+
+  struct BatchSizesListener {
+    atomic_size_t seen_;
+    std::vector<size_t> batch_sizes_;
+    BatchSizesListener() : seen_(0u) {}
+    bool EntryBatch(const sherlock::EntriesRange<Record>& entries, size_t, size_t) {
+      batch_sizes_.push_back(entries.size());
+      seen_ += entries.size();
+      return seen_ < 1001u;
+    }
+    bool Terminate() { return false; }
+  };
+
+  BatchSizesListener listener;
+  auto scope = published_in_batches.SyncSubscribe(listener);
+  while (listener.seen_ < 1u) {
+    ;  // Spin lock.
+  }
+  std::vector<Record> batch;
+  for (int i = 1; i <= 1000; ++i) {
+    batch.emplace_back(i);
+  }
+  const std::pair<size_t, size_t> range = published_in_batches.PublishBatch(batch);
+  EXPECT_EQ(1u, range.first);
+  EXPECT_EQ(1001u, range.second);
+  scope.Join();
+  ASSERT_EQ(2u, listener.batch_sizes_.size());
+  EXPECT_EQ(1u, listener.batch_sizes_[0]);
+  EXPECT_EQ(1000u, listener.batch_sizes_[1]);  // Not a single entry of the batch has been seen before the rest.
+
+  const std::pair<size_t, size_t> empty_range = published_in_batches.PublishBatch(batch.end(), batch.end());
+  EXPECT_EQ(1001u, empty_range.first);
+  EXPECT_EQ(1001u, empty_range.second);
+}
+
+TEST(Sherlock, ConcurrentPublishersAddAllEntriesInOrderOfTheirTurns) {
+  auto stream = sherlock::Stream<Record>("concurrent");
+  stream.EnableConcurrentPublishers();
+  const int kThreads = 4;
+  const int kEntriesPerThread = 1000;
+  std::vector<thread> publishers;
+  for (int t = 0; t < kThreads; ++t) {
+    publishers.emplace_back([&stream, t]() {
+      for (int i = 0; i < kEntriesPerThread; ++i) {
+        if (i % 100 == 99) {
+          stream.PublishBatch(std::vector<Record>{Record(t * kEntriesPerThread + i)});
+        } else {
+          stream.Publish(Record(t * kEntriesPerThread + i));
+        }
+      }
+    });
+  }
+
+  struct Collector {
+    std::vector<int> xs_;
+    bool Entry(const Record& entry, size_t index, size_t total) {
+      static_cast<void>(total);
+      xs_.push_back(entry.x_);
+      return index + 1u < static_cast<size_t>(kThreads * kEntriesPerThread);
+    }
+    bool Terminate() { return false; }
+  };
+  Collector collector;
+  stream.SyncSubscribe(collector).Join();
+  for (auto& publisher : publishers) {
+    publisher.join();
+  }
+
+  // Every entry is there once, and the ones of each publisher come in the order it has published them.
+  ASSERT_EQ(static_cast<size_t>(kThreads * kEntriesPerThread), collector.xs_.size());
+  std::vector<int> last_seen(kThreads, -1);
+  for (int x : collector.xs_) {
+    EXPECT_GT(x % kEntriesPerThread, last_seen[x / kEntriesPerThread]);
+    last_seen[x / kEntriesPerThread] = x % kEntriesPerThread;
+  }
+  EXPECT_EQ(std::vector<int>(kThreads, kEntriesPerThread - 1), last_seen);
+}
+
+TEST(Sherlock, ConcurrentPublishersCanNotGoBackInTime) {
+  CleanTestDirectory(FLAGS_sherlock_test_tmpdir, "concurrent_persisted");
+
+  {
+    auto stream = sherlock::Stream<RecordWithTimestamp>("concurrent_persisted",
+                                                        sherlock::Persistence(FLAGS_sherlock_test_tmpdir));
+    stream.EnableConcurrentPublishers();
+    EXPECT_EQ(0u, stream.Publish(RecordWithTimestamp("one", EPOCH_MILLISECONDS(100))));
+    EXPECT_EQ(1u, stream.Publish(RecordWithTimestamp("two", EPOCH_MILLISECONDS(100))));
+    EXPECT_THROW(stream.Publish(RecordWithTimestamp("late", EPOCH_MILLISECONDS(99))),
+                 sherlock::InconsistentTimestampException);
+    const std::vector<RecordWithTimestamp> batch{RecordWithTimestamp("three", EPOCH_MILLISECONDS(101)),
+                                                 RecordWithTimestamp("late", EPOCH_MILLISECONDS(99))};
+    EXPECT_THROW(stream.PublishBatch(batch), sherlock::InconsistentTimestampException);
+    EXPECT_EQ(2u, stream.Publish(RecordWithTimestamp("three", EPOCH_MILLISECONDS(101))));
+  }
+
+  // None of the rejected entries have made it to the disk.
+  sherlock::Streams().Shutdown("concurrent_persisted");
+  auto restarted_stream = sherlock::Stream<RecordWithTimestamp>(
+      "concurrent_persisted", sherlock::Persistence(FLAGS_sherlock_test_tmpdir));
+  EXPECT_EQ(3u, restarted_stream.Publish(RecordWithTimestamp("four", EPOCH_MILLISECONDS(102))));
+}
+
+TEST(Sherlock, ConcurrentPublishersCanNotGoBackInTimeWithAllEntriesInHistory) {
+  const std::string directory = CleanTestDirectory(FLAGS_sherlock_test_tmpdir, "concurrent_history");
+  {
+    // All the entries are in finalized files, so none of them are in memory once the stream is started.
+    sherlock::storage::FileLog<RecordWithTimestamp> log(
+        directory, sherlock::storage::FileLogPolicy(), typeid(RecordWithTimestamp).name(), true);
+    log.Append(RecordWithTimestamp("one", EPOCH_MILLISECONDS(100)), 0u, 100u);
+    log.Finalize();
+  }
+
+  auto stream = sherlock::Stream<RecordWithTimestamp>("concurrent_history",
+                                                      sherlock::Persistence(FLAGS_sherlock_test_tmpdir));
+  stream.EnableConcurrentPublishers();
+  EXPECT_EQ(1u, stream.Size());
+  EXPECT_THROW(stream.Publish(RecordWithTimestamp("late", EPOCH_MILLISECONDS(99))),
+               sherlock::InconsistentTimestampException);
+  const std::vector<RecordWithTimestamp> batch{RecordWithTimestamp("late", EPOCH_MILLISECONDS(99))};
+  EXPECT_THROW(stream.PublishBatch(batch), sherlock::InconsistentTimestampException);
+  EXPECT_EQ(1u, stream.Publish(RecordWithTimestamp("two", EPOCH_MILLISECONDS(100))));
+}
+
+TEST(Sherlock, HeadCanNotPrecedeEntriesInHistory) {
+  const std::string directory = CleanTestDirectory(FLAGS_sherlock_test_tmpdir, "head_history");
+  {
+    sherlock::storage::FileLog<RecordWithTimestamp> log(
+        directory, sherlock::storage::FileLogPolicy(), typeid(RecordWithTimestamp).name(), true);
+    log.Append(RecordWithTimestamp("one", EPOCH_MILLISECONDS(100)), 0u, 100u);
+    log.Finalize();
+  }
+
+  auto stream =
+      sherlock::Stream<RecordWithTimestamp>("head_history", sherlock::Persistence(FLAGS_sherlock_test_tmpdir));
+  EXPECT_THROW(stream.UpdateHead(EPOCH_MILLISECONDS(99)), sherlock::InconsistentTimestampException);
+  stream.UpdateHead(EPOCH_MILLISECONDS(100));
+}
+
+TEST(Sherlock, ListenersRunOnPool) {
+  auto pooled_stream = sherlock::Stream<Record>("pooled");
+  sherlock::scheduler::WorkerPool pool(2);
+
+  // Many more listeners than threads, each expected to see all the entries in order.
+  struct OrderCheckingListener {
+    size_t seen_ = 0u;
+    int sum_ = 0;
+    bool in_order_ = true;
+    bool Entry(const Record& entry, size_t index, size_t) {
+      in_order_ = in_order_ && (index == seen_);
+      ++seen_;
+      sum_ += entry.x_;
+      return index < 999u;
+    }
+    bool Terminate() { return false; }  // Keep going until all the entries are seen.
+  };
+  std::vector<OrderCheckingListener> listeners(100);
+  std::vector<sherlock::StreamInstance<Record>::SyncListenerScope<OrderCheckingListener>> scopes;
+  for (OrderCheckingListener& listener : listeners) {
+    scopes.push_back(pooled_stream.SyncSubscribe(listener, pool));
+  }
+  for (int i = 0; i < 1000; ++i) {
+    pooled_stream.Publish(i);
+  }
+  for (auto& scope : scopes) {
+    scope.Join();
+  }
+  for (const OrderCheckingListener& listener : listeners) {
+    EXPECT_EQ(1000u, listener.seen_);
+    EXPECT_EQ(999 * 1000 / 2, listener.sum_);
+    EXPECT_TRUE(listener.in_order_);
+  }
+
+  // `Terminate()` works the same way as it does for the listeners running in their own threads.
+  Data d;
+  {
+    Processor p(d, true);
+    auto scope = pooled_stream.SyncSubscribe(p, pool, 998u);
+    while (d.seen_ < 2u) {
+      ;  // Spin lock.
+    }
+    scope.Join();
+  }
+  EXPECT_EQ("998,999,TERMINATE", d.results_);
+
+  // Detached listeners are freed once done.
+  Data d2;
+  std::unique_ptr<Processor> p2(make_unique<Processor>(d2, false));
+  p2->SetMax(2u);
+  auto async_scope = pooled_stream.AsyncSubscribe(std::move(p2), pool, 999u);
+  async_scope.Detach();
+  pooled_stream.Publish(1000);
+  while (d2.listener_alive_) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("999,1000", d2.results_);
+}
+
+TEST(Sherlock, ListenersAreWokenUpAndJoinedWithoutPolling) {
+  // A listener that has caught up registers to be woken up, and the publisher wakes it up right as it commits
+  // the entry, from its own thread. Thus, no time needs to pass for this test, and none is measured;
+  // see `storage/benchmark.cc` for the wakeup latency.
+  struct CountingWakeable : sherlock::scheduler::Wakeable {
+    size_t woken_ = 0u;
+    void Wake() override { ++woken_; }
+  };
+  sherlock::StreamData<Record> data;
+  const auto listener = std::make_shared<CountingWakeable>();
+  data.WakeUpWhenAvailable(0u, listener);
+  EXPECT_EQ(0u, listener->woken_);
+  data.Emplace(0);
+  EXPECT_EQ(1u, listener->woken_);
+  // The registration is dropped once the listener has been woken up.
+  data.Emplace(1);
+  EXPECT_EQ(1u, listener->woken_);
+  // The listener registering for the entry that is already there is woken up right away.
+  data.WakeUpWhenAvailable(1u, listener);
+  EXPECT_EQ(2u, listener->woken_);
+  // So is the listener waiting for the stream to be shut down, once it is.
+  data.WakeUpWhenAvailable(2u, listener, true);
+  EXPECT_EQ(2u, listener->woken_);
+  data.Shutdown();
+  EXPECT_EQ(3u, listener->woken_);
+
+  // The listeners that have gone to sleep are woken up to terminate. There is no polling to fall back to,
+  // so a lost wakeup would have this test hang on `Join()`.
+  auto stream = sherlock::Stream<Record>("wakeups");
+  struct NeverDoneListener {
+    bool Entry(const Record&, size_t, size_t) { return true; }
+  };
+  std::vector<std::unique_ptr<NeverDoneListener>> listeners;
+  std::vector<sherlock::StreamInstance<Record>::SyncListenerScope<NeverDoneListener>> scopes;
+  for (size_t i = 0; i < 100u; ++i) {
+    listeners.push_back(make_unique<NeverDoneListener>());
+    scopes.push_back(stream.SyncSubscribe(*listeners.back()));
+  }
+  stream.Publish(42);
+  for (auto& scope : scopes) {
+    scope.Join();
+  }
+}
+
+TEST(Sherlock, PersistentStreamNamesMustBeDirectoryNames) {
+  for (const std::string& name : std::vector<std::string>{"", ".", "..", "../outside", "a/b", "a\\b"}) {
+    EXPECT_THROW(sherlock::Stream<RecordWithTimestamp>(name, sherlock::Persistence(FLAGS_sherlock_test_tmpdir)),
+                 sherlock::InvalidStreamNameException);
+    EXPECT_FALSE(sherlock::Streams().Has(name));
+  }
+}
+
+TEST(Sherlock, PersistentStreamPicksUpEntriesAfterRestart) {
+  const std::string directory = CleanTestDirectory(FLAGS_sherlock_test_tmpdir, "persisted");
+
+  sherlock::storage::FileLogPolicy policy;
+  policy.max_entries_per_file = 2;
+  {
+    auto stream = sherlock::Stream<RecordWithTimestamp>(
+        "persisted", sherlock::Persistence(FLAGS_sherlock_test_tmpdir, policy));
+    stream.Publish(RecordWithTimestamp("one", EPOCH_MILLISECONDS(100)));
+    // The batch is persisted as a whole, even though it spans two files.
+    const std::vector<RecordWithTimestamp> batch{RecordWithTimestamp("two", EPOCH_MILLISECONDS(200)),
+                                                 RecordWithTimestamp("three", EPOCH_MILLISECONDS(300))};
+    const std::pair<size_t, size_t> range = stream.PublishBatch(batch);
+    EXPECT_EQ(1u, range.first);
+    EXPECT_EQ(3u, range.second);
+  }
+
+  // The order keys in the names of finalized files are the timestamps of the entries.
+  std::vector<string> file_names;
+  bricks::FileSystem::ScanDir(directory,
+                              [&file_names](const std::string& name) { file_names.push_back(name); });
+  std::sort(file_names.begin(), file_names.end());
+  ASSERT_EQ(2u, file_names.size());
+  EXPECT_EQ("active", file_names[0]);
+  EXPECT_EQ("finalized.00000000000000000000-00000000000000000001.00000000000000000100-00000000000000000200",
+            file_names[1]);
+
+  // The stream of the same name can be registered again once the previous one has been shut down.
+  sherlock::Streams().Shutdown("persisted");
+  auto restarted_stream = sherlock::Stream<RecordWithTimestamp>(
+      "persisted", sherlock::Persistence(FLAGS_sherlock_test_tmpdir, policy));
+  EXPECT_EQ(3u, restarted_stream.Publish(RecordWithTimestamp("four", EPOCH_MILLISECONDS(400))));
+  // Only the entries published since the restart count as published.
+  EXPECT_EQ(4u, restarted_stream.Stats().entries);
+  EXPECT_EQ(1u, restarted_stream.Stats().entries_published);
+  EXPECT_LT(0u, restarted_stream.Stats().bytes_persisted);
+
+  struct Collector {
+    string results_;
+    bool Entry(const RecordWithTimestamp& entry, size_t index, size_t) {
+      results_ += Printf("%s%s@%d", results_.empty() ? "" : ",", entry.s_.c_str(), int(entry.timestamp_));
+      return index < 3u;
+    }
+    bool Terminate() { return false; }
+  };
+  Collector collector;
+  restarted_stream.SyncSubscribe(collector).Join();
+  EXPECT_EQ("one@100,two@200,three@300,four@400", collector.results_);
+
+  // The entries from the finalized files are read from the storage, and passed as a separate batch.
+  struct BatchCollector {
+    string results_;
+    bool EntryBatch(const sherlock::EntriesRange<RecordWithTimestamp>& entries, size_t first_index, size_t) {
+      results_ += Printf("[%d:", int(first_index));
+      for (const RecordWithTimestamp& entry : entries) {
+        results_ += ' ' + entry.s_;
+      }
+      results_ += ']';
+      return first_index + entries.size() < 4u;
+    }
+    bool Terminate() { return false; }
+  };
+  BatchCollector batch_collector;
+  restarted_stream.SyncSubscribe(batch_collector).Join();
+  EXPECT_EQ("[0: one two][2: three four]", batch_collector.results_);
+
+  // Subscribing from a given index locates the right finalized file without replaying the ones before it.
+  Collector another_collector;
+  restarted_stream.SyncSubscribe(another_collector, 1u).Join();
+  EXPECT_EQ("two@200,three@300,four@400", another_collector.results_);
+
+  BatchCollector another_batch_collector;
+  restarted_stream.SyncSubscribe(another_batch_collector, 1u).Join();
+  EXPECT_EQ("[1: two][2: three four]", another_batch_collector.results_);
+}
+
+// Counts its instances, to tell how many entries are kept in memory.
+struct CountedRecord {
+  int x_;
+  CountedRecord(int x = 0) : x_(x) { ++Alive(); }
+  CountedRecord(const CountedRecord& rhs) : x_(rhs.x_) { ++Alive(); }
+  ~CountedRecord() { --Alive(); }
+  static std::atomic_int& Alive() {
+    static std::atomic_int alive(0);
+    return alive;
+  }
+  template <typename A>
+  void serialize(A& ar) {
+    ar(cereal::make_nvp("x", x_));
+  }
+};
+
+TEST(Sherlock, PersistentStreamKeepsOnlyRecentEntriesInMemory) {
+  CleanTestDirectory(FLAGS_sherlock_test_tmpdir, "bounded");
+
+  sherlock::Persistence persistence(FLAGS_sherlock_test_tmpdir);
+  persistence.policy.max_entries_per_file = 1000;
+  persistence.memory.max_entries = 2000;
+  auto stream = sherlock::Stream<CountedRecord>("bounded", persistence);
+  for (int i = 0; i < 20000; ++i) {
+    stream.Publish(CountedRecord(i));
+  }
+  // The entries in memory are the most recent ones within the limit, plus up to a file more, as the files are
+  // dropped from memory as a whole, plus up to a block of entries more, as the memory is freed in blocks.
+  const int kMaxAlive = 2000 + 1000 + 4096;
+  EXPECT_LE(CountedRecord::Alive(), kMaxAlive);
+
+  // The listener starting from the beginning of the stream reads the entries dropped from memory
+  // from the files, and then switches over to the ones in memory, while more entries are published and dropped.
+  struct Collector {
+    size_t seen_ = 0u;
+    bool in_order_ = true;
+    bool Entry(const CountedRecord& entry, size_t index, size_t) {
+      in_order_ = in_order_ && entry.x_ == static_cast<int>(index) && index == seen_;
+      ++seen_;
+      return seen_ < 25000u;
+    }
+    bool Terminate() { return false; }
+  };
+  Collector collector;
+  {
+    auto scope = stream.SyncSubscribe(collector);
+    for (int i = 20000; i < 25000; ++i) {
+      stream.Publish(CountedRecord(i));
+    }
+    scope.Join();
+  }
+  EXPECT_EQ(25000u, collector.seen_);
+  EXPECT_TRUE(collector.in_order_);
+  EXPECT_LE(CountedRecord::Alive(), kMaxAlive);
+}
+
+TEST(Sherlock, StreamsAreRegisteredOncePerName) {
+  auto stream = sherlock::Stream<Record>("registered");
+  EXPECT_THROW(sherlock::Stream<Record>("registered"), sherlock::StreamAlreadyExistsException);
+  EXPECT_THROW(sherlock::Stream<RecordWithTimestamp>("registered"), sherlock::StreamAlreadyExistsException);
+  EXPECT_TRUE(sherlock::Streams().Has("registered"));
+  const std::vector<std::string> names = sherlock::Streams().Names();
+  EXPECT_TRUE(std::is_sorted(names.begin(), names.end()));
+  EXPECT_TRUE(std::find(names.begin(), names.end(), "registered") != names.end());
+
+  // The stream found by name is the same stream.
+  auto found = sherlock::Streams().Find<Record>("registered");
+  EXPECT_EQ(0u, stream.Publish(1));
+  EXPECT_EQ(1u, found.Publish(2));
+  EXPECT_THROW(sherlock::Streams().Find<RecordWithTimestamp>("registered"),
+               sherlock::StreamTypeMismatchException);
+  EXPECT_THROW(sherlock::Streams().Find<Record>("not_registered"), sherlock::StreamNotFoundException);
+  EXPECT_THROW(sherlock::Streams().Shutdown("not_registered"), sherlock::StreamNotFoundException);
+
+  // Once shut down, the stream rejects new entries, and its name is free to be registered again.
+  sherlock::Streams().Shutdown("registered");
+  EXPECT_FALSE(sherlock::Streams().Has("registered"));
+  EXPECT_THROW(stream.Publish(3), sherlock::StreamIsShutDownException);
+  EXPECT_THROW(found.PublishBatch(std::vector<Record>{3, 4}), sherlock::StreamIsShutDownException);
+  auto registered_again = sherlock::Stream<Record>("registered");
+  EXPECT_EQ(0u, registered_again.Publish(3));
+}
+
+TEST(Sherlock, ShutdownTerminatesListenersAndWaitsForThem) {
+  auto stream = sherlock::Stream<Record>("shut_down");
+  sherlock::scheduler::WorkerPool pool(1);
+  stream.Publish(1);
+  Data thread_data;
+  Data pooled_data;
+  stream.AsyncSubscribe(std::unique_ptr<Processor>(new Processor(thread_data, true))).Detach();
+  stream.AsyncSubscribe(std::unique_ptr<Processor>(new Processor(pooled_data, true)), pool).Detach();
+  while (thread_data.seen_ < 1u || pooled_data.seen_ < 1u) {
+    ;  // Spin lock.
+  }
+  // The detached listeners are told to terminate, and are done by the time `Shutdown()` returns.
+  sherlock::Streams().Shutdown("shut_down");
+  EXPECT_EQ("1,TERMINATE", thread_data.results_);
+  EXPECT_EQ("1,TERMINATE", pooled_data.results_);
+  while (thread_data.listener_alive_ || pooled_data.listener_alive_) {
+    ;  // Spin lock: the listeners are destroyed right after they are done with the stream.
+  }
+
+  // The listeners subscribing after the shutdown are told to terminate right away.
+  Data late_data;
+  stream.AsyncSubscribe(std::unique_ptr<Processor>(new Processor(late_data, true)), 1u).Detach();
+  while (late_data.listener_alive_) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ("TERMINATE", late_data.results_);
+}
+
+TEST(Sherlock, SlowListenersAreDisconnectedOrSkippedToLive) {
+  auto stream = sherlock::Stream<Record>("slow");
+  for (int i = 1; i <= 5; ++i) {
+    stream.Publish(i);
+  }
+
+  typedef sherlock::SlowListenerPolicy::Action Action;
+
+  // Five entries behind with at most two allowed, this listener is disconnected right away.
+  stream.SetSlowListenerPolicy(sherlock::SlowListenerPolicy(Action::Disconnect, 2u));
+  Data disconnected_data;
+  auto disconnected_scope =
+      stream.AsyncSubscribe(std::unique_ptr<Processor>(new Processor(disconnected_data, false)));
+  while (!stream.ListenersStats().empty()) {
+    ;  // Spin lock.
+  }
+  disconnected_scope.Join();
+  EXPECT_EQ("TERMINATE", disconnected_data.results_);
+
+  // And this one skips what it is behind on, and only gets the new entries.
+  stream.SetSlowListenerPolicy(sherlock::SlowListenerPolicy(Action::SkipToLive, 2u));
+  Data skipped_data;
+  std::unique_ptr<Processor> skipped(new Processor(skipped_data, false));
+  skipped->SetMax(2u);
+  auto scope = stream.AsyncSubscribe(std::move(skipped));
+  std::vector<sherlock::ListenerStats> stats;
+  do {
+    stats = stream.ListenersStats();
+    ASSERT_EQ(1u, stats.size());
+  } while (stats[0].cursor != 5u);
+  stream.Publish(6);
+  do {
+    stats = stream.ListenersStats();
+    ASSERT_EQ(1u, stats.size());
+  } while (stats[0].cursor != 6u);
+  EXPECT_EQ(0u, stats[0].lag);
+  EXPECT_EQ(1u, stats[0].entries_passed);
+  EXPECT_EQ(5u, stats[0].entries_skipped);
+  stream.Publish(7);
+  while (skipped_data.seen_ < 2u) {
+    ;  // Spin lock.
+  }
+  scope.Join();
+  EXPECT_EQ("6,7", skipped_data.results_);
+  EXPECT_TRUE(stream.ListenersStats().empty());
+}
+
+// Holds on to each entry until let go of, to fall behind the stream on purpose.
+struct GatedProcessor final {
+  atomic_bool& open_;
+  atomic_size_t& seen_;
+  GatedProcessor(atomic_bool& open, atomic_size_t& seen) : open_(open), seen_(seen) {}
+  bool Entry(const Record&, size_t, size_t) {
+    while (!open_) {
+      sleep_for(milliseconds(1));
+    }
+    ++seen_;
+    return true;
+  }
+};
+
+TEST(Sherlock, SlowListenersBlockPublisherForNoLongerThanAllowed) {
+  auto stream = sherlock::Stream<Record>("blocking");
+  sherlock::SlowListenerPolicy policy(sherlock::SlowListenerPolicy::Action::BlockPublisher, 1u);
+  policy.max_publisher_wait = milliseconds(50);
+  stream.SetSlowListenerPolicy(policy);
+  atomic_bool open(false);
+  atomic_size_t seen(0u);
+  GatedProcessor listener(open, seen);
+  auto scope = stream.SyncSubscribe(listener);
+
+  // Not behind by more than one entry yet, so the publisher does not wait.
+  stream.Publish(1);
+  stream.Publish(2);
+  EXPECT_EQ(2u, stream.ListenersStats()[0].lag);
+
+  // Now it is, so the publisher waits for it, and gives up after `max_publisher_wait`.
+  const auto start = std::chrono::steady_clock::now();
+  stream.Publish(3);
+  EXPECT_GE(std::chrono::steady_clock::now() - start, milliseconds(50));
+
+  // Once it is let go of, it catches up, and the publisher does not wait for it.
+  open = true;
+  while (seen < 3u) {
+    ;  // Spin lock.
+  }
+  stream.Publish(4);
+  while (seen < 4u) {
+    ;  // Spin lock.
+  }
+  scope.Join();
+}
+
+TEST(Sherlock, BlockedPublisherIsWokenUpOnceSlowListenerCatchesUp) {
+  auto stream = sherlock::Stream<Record>("blocked");
+  sherlock::SlowListenerPolicy policy(sherlock::SlowListenerPolicy::Action::BlockPublisher, 1u);
+  policy.max_publisher_wait = std::chrono::hours(1);
+  stream.SetSlowListenerPolicy(policy);
+  atomic_bool open(false);
+  atomic_size_t seen(0u);
+  GatedProcessor listener(open, seen);
+  auto scope = stream.SyncSubscribe(listener);
+  stream.Publish(1);
+  stream.Publish(2);
+  thread opener([&open]() {
+    sleep_for(milliseconds(10));
+    open = true;
+  });
+  stream.Publish(3);  // Would block for an hour if the listener catching up did not wake it up.
+  opener.join();
+  while (seen < 3u) {
+    ;  // Spin lock.
+  }
+  scope.Join();
+}
+
+// Counts the times it has caught up with the stream.
+struct CatchingUpProcessor final {
+  atomic_size_t& seen_;
+  atomic_size_t& caught_up_;
+  CatchingUpProcessor(atomic_size_t& seen, atomic_size_t& caught_up) : seen_(seen), caught_up_(caught_up) {}
+  bool Entry(const Record&, size_t, size_t) {
+    ++seen_;
+    return true;
+  }
+  bool Entry(const RecordWithTimestamp&, size_t, size_t) {
+    ++seen_;
+    return true;
+  }
+  void CaughtUp() { ++caught_up_; }
+};
+
+TEST(Sherlock, CaughtUpIsCalledOnceReplayedAndAgainAfterFallingBehind) {
+  auto stream = sherlock::Stream<Record>("catching_up");
+  stream.Publish(1);
+  stream.Publish(2);
+  stream.Publish(3);
+  sherlock::scheduler::WorkerPool pool(1);
+  atomic_size_t thread_seen(0u);
+  atomic_size_t thread_caught_up(0u);
+  atomic_size_t pooled_seen(0u);
+  atomic_size_t pooled_caught_up(0u);
+  CatchingUpProcessor thread_listener(thread_seen, thread_caught_up);
+  CatchingUpProcessor pooled_listener(pooled_seen, pooled_caught_up);
+  auto thread_scope = stream.SyncSubscribe(thread_listener);
+  auto pooled_scope = stream.SyncSubscribe(pooled_listener, pool);
+  while (thread_caught_up < 1u || pooled_caught_up < 1u) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(3u, thread_seen);
+  EXPECT_EQ(3u, pooled_seen);
+  for (const auto& stats : stream.ListenersStats()) {
+    EXPECT_TRUE(stats.caught_up);
+  }
+
+  // A few new entries do not make the listeners fall behind.
+  stream.Publish(4);
+  while (thread_seen < 4u || pooled_seen < 4u) {
+    ;  // Spin lock.
+  }
+
+  // Many new entries at once do, and the listeners catch up once again.
+  const std::vector<Record> many(sherlock::StreamData<Record>::kMaxCaughtUpLag + 1, Record(42));
+  stream.PublishBatch(many);
+  while (thread_caught_up < 2u || pooled_caught_up < 2u) {
+    ;  // Spin lock.
+  }
+  EXPECT_EQ(4u + many.size(), thread_seen);
+  EXPECT_EQ(4u + many.size(), pooled_seen);
+  thread_scope.Join();
+  pooled_scope.Join();
+  EXPECT_EQ(2u, thread_caught_up);
+  EXPECT_EQ(2u, pooled_caught_up);
+}
+
+TEST(Sherlock, StreamStatsAreServedViaHTTP) {
+  auto stream = sherlock::Stream<RecordWithTimestamp>("with_stats");
+  stream.Emplace("one", EPOCH_MILLISECONDS(1));
+  stream.Emplace("two", EPOCH_MILLISECONDS(2));
+  atomic_size_t seen(0u);
+  atomic_size_t caught_up(0u);
+  CatchingUpProcessor listener(seen, caught_up);
+  auto scope = stream.SyncSubscribe(listener);
+  while (!caught_up) {
+    ;  // Spin lock.
+  }
+  stream.PublishBatch(std::vector<RecordWithTimestamp>{RecordWithTimestamp("three", EPOCH_MILLISECONDS(3)),
+                                                       RecordWithTimestamp("four", EPOCH_MILLISECONDS(4))});
+  while (seen < 4u) {
+    ;  // Spin lock.
+  }
+  while (!stream.Stats().delivery.count) {
+    ;  // Spin lock: the latency is recorded right after the entries are passed.
+  }
+
+  HTTP(FLAGS_sherlock_http_test_port).ResetAllHandlers();
+  HTTP(FLAGS_sherlock_http_test_port).Register("/with_stats", stream);
+  sherlock::StreamStats stats;
+  ParseJSON(HTTP(GET(Printf("http://localhost:%d/with_stats?stats", FLAGS_sherlock_http_test_port))).body,
+            stats);
+  EXPECT_EQ(4u, stats.entries);
+  EXPECT_EQ(4u, stats.entries_published);
+  EXPECT_EQ(0u, stats.bytes_persisted);
+  EXPECT_EQ(3u, stats.publish.count);
+  EXPECT_GE(stats.delivery.count, 1u);
+  ASSERT_EQ(1u, stats.listeners.size());
+  EXPECT_EQ(4u, stats.listeners[0].cursor);
+  EXPECT_EQ(0u, stats.listeners[0].lag);
+  EXPECT_TRUE(stats.listeners[0].caught_up);
+  scope.Join();
+}
+
+// Collects the entries and the heads, in the order they have been passed to it.
+struct HeadCollector final {
+  std::mutex& mutex_;
+  std::vector<std::string>& events_;
+  HeadCollector(std::mutex& mutex, std::vector<std::string>& events) : mutex_(mutex), events_(events) {}
+  bool Entry(const RecordWithTimestamp& entry, size_t, size_t) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back(entry.s_);
+    return true;
+  }
+  void HeadUpdated(EPOCH_MILLISECONDS head) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back("head:" + ToString(static_cast<uint64_t>(head)));
+  }
+};
+
+TEST(Sherlock, HeadUpdatesAreDeliveredWithoutNewEntries) {
+  auto stream = sherlock::Stream<RecordWithTimestamp>("head_updates");
+  stream.Publish(RecordWithTimestamp("one", EPOCH_MILLISECONDS(100)));
+  sherlock::scheduler::WorkerPool pool(1);
+  std::mutex mutex;
+  std::vector<std::string> thread_events;
+  std::vector<std::string> pooled_events;
+  HeadCollector thread_listener(mutex, thread_events);
+  HeadCollector pooled_listener(mutex, pooled_events);
+  auto thread_scope = stream.SyncSubscribe(thread_listener);
+  auto pooled_scope = stream.SyncSubscribe(pooled_listener, pool);
+  const auto wait_for = [&mutex](const std::vector<std::string>& events, size_t n) {
+    while (true) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (events.size() >= n) {
+        break;
+      }
+    }
+  };
+  wait_for(thread_events, 1u);
+  wait_for(pooled_events, 1u);
+
+  // The head moves on without new entries, and can not go back in time.
+  stream.UpdateHead(EPOCH_MILLISECONDS(200));
+  wait_for(thread_events, 2u);
+  wait_for(pooled_events, 2u);
+  EXPECT_THROW(stream.UpdateHead(EPOCH_MILLISECONDS(150)), sherlock::InconsistentTimestampException);
+
+  // The head updated before the entries published since is not passed to the listeners again.
+  stream.Publish(RecordWithTimestamp("two", EPOCH_MILLISECONDS(300)));
+  EXPECT_THROW(stream.UpdateHead(EPOCH_MILLISECONDS(250)), sherlock::InconsistentTimestampException);
+  stream.UpdateHead(EPOCH_MILLISECONDS(400));
+  wait_for(thread_events, 4u);
+  wait_for(pooled_events, 4u);
+
+  // The entries timestamped before the head are rejected, even with a single publisher.
+  EXPECT_THROW(stream.Publish(RecordWithTimestamp("late", EPOCH_MILLISECONDS(350))),
+               sherlock::InconsistentTimestampException);
+  const std::vector<RecordWithTimestamp> batch{RecordWithTimestamp("late", EPOCH_MILLISECONDS(350))};
+  EXPECT_THROW(stream.PublishBatch(batch), sherlock::InconsistentTimestampException);
+  EXPECT_EQ(2u, stream.Size());
+  thread_scope.Join();
+  pooled_scope.Join();
+  const std::vector<std::string> expected{"one", "head:200", "two", "head:400"};
+  EXPECT_EQ(expected, thread_events);
+  EXPECT_EQ(expected, pooled_events);
+}
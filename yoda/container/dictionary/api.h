@@ -87,12 +87,11 @@ struct Container<YT, Dictionary<ENTRY>> {
   YET operator()(type_inference::template YETFromSubscript<std::tuple<typename YET::T_KEY>>);
 
   // Event: The entry has been scanned from the stream.
-  // Save a copy! Stream provides copies of entries, that are desined to be `std::move()`-d away.
-  // TODO(dkorolev): For this parameter to be an `ENTRY&&`, we'd need to clean up Bricks wrt RTTI.
-  void operator()(ENTRY& entry, size_t index) {
+  // The entry is the one stored in the stream, so a copy is saved, and only if it is newer than the one kept.
+  void operator()(const ENTRY& entry, size_t index) {
     EntryWithIndex<ENTRY>& placeholder = map_[GetKey(entry)];
     if (index > placeholder.index) {
-      placeholder.Update(index, std::move(entry));
+      placeholder.Update(index, entry);
     }
   }
 
@@ -117,10 +117,11 @@ struct Container<YT, MatrixEntry<ENTRY>> {
   YET operator()(type_inference::template YETFromSubscript<typename YET::T_COL>);
 
   // Event: The entry has been scanned from the stream.
-  void operator()(ENTRY& entry, size_t index) {
+  // The entry is the one stored in the stream, so a copy is saved, and only if it is newer than the one kept.
+  void operator()(const ENTRY& entry, size_t index) {
     std::unique_ptr<EntryWithIndex<ENTRY>>& placeholder = map_[std::make_pair(GetRow(entry), GetCol(entry))];
     if (index > placeholder->index) {
-      placeholder->Update(index, std::move(entry));
+      placeholder->Update(index, entry);
       forward_[GetRow(entry)][GetCol(entry)] = &placeholder->entry;
       transposed_[GetCol(entry)][GetRow(entry)] = &placeholder->entry;
     }
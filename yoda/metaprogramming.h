@@ -33,6 +33,7 @@ SOFTWARE.
 #include <functional>
 #include <future>
 #include <utility>
+#include <vector>
 
 #include "types.h"
 #include "sfinae.h"
@@ -208,24 +209,36 @@ struct StreamListener {
 
   explicit StreamListener(typename YT::T_MQ& mq) : mq_(mq) {}
 
-  struct MQMessageEntry : MQMessage<typename YT::T_SUPPORTED_TYPES_AS_TUPLE> {
-    std::unique_ptr<Padawan> entry;
-    const size_t index;
+  // The entries passed to the listener at once, in one message. Refers to the entries stored in the stream,
+  // which never move, and outlive the message queue: the stream of Yoda is kept in memory, and is destroyed
+  // after the queue, see `APIWrapper`.
+  struct MQMessageEntries : MQMessage<typename YT::T_SUPPORTED_TYPES_AS_TUPLE> {
+    std::vector<const Padawan*> entries;
+    const size_t first_index;
 
-    MQMessageEntry(std::unique_ptr<Padawan>&& entry, size_t index) : entry(std::move(entry)), index(index) {}
+    explicit MQMessageEntries(size_t first_index) : first_index(first_index) {}
 
     virtual void Process(YodaContainer<YT>& container, YodaData<YT>, typename YT::T_STREAM_TYPE&) override {
-      // TODO(dkorolev): For this call, `entry`, the first parameter, should be `std::move()`-d,
-      // but Bricks doesn't support it yet for `RTTIDynamicCall`.
-      MP::RTTIDynamicCall<typename YT::T_UNDERLYING_TYPES_AS_TUPLE>(entry, container, index);
+      // The containers copy the entries they keep, so no entry is copied until it is known to be needed.
+      size_t index = first_index;
+      for (const Padawan* entry : entries) {
+        MP::RTTIDynamicCall<typename YT::T_UNDERLYING_TYPES_AS_TUPLE>(*entry, container, index++);
+      }
     }
   };
 
-  // Sherlock stream listener call.
-  bool Entry(std::unique_ptr<Padawan>& entry, size_t index, size_t total) {
+  // Sherlock stream listener call. Accepts all the available entries at once, to replay the stream faster.
+  bool EntryBatch(const sherlock::EntriesRange<std::unique_ptr<Padawan>>& entries,
+                  size_t first_index,
+                  size_t total) {
     static_cast<void>(total);
 
-    mq_.EmplaceMessage(new MQMessageEntry(std::move(entry), index));
+    std::unique_ptr<MQMessageEntries> message(new MQMessageEntries(first_index));
+    message->entries.reserve(entries.size());
+    for (const std::unique_ptr<Padawan>& entry : entries) {
+      message->entries.push_back(entry.get());
+    }
+    mq_.EmplaceMessage(message.release());
 
     // Eventually, the logic of this API implementation is:
     // * Defer all API requests until the persistent part of the stream is fully replayed,
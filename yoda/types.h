@@ -36,10 +36,13 @@ SOFTWARE.
 #include "../../Bricks/time/chrono.h"
 #include "../../Bricks/net/api/api.h"
 
+#include "../storage/arena.h"
+
 namespace yoda {
 
 // All user entries, which are supposed to be stored in Yoda, should be derived from this base class.
-struct Padawan {
+// They are allocated from the arena shared by all Yoda streams, not one by one from the heap.
+struct Padawan : sherlock::storage::ArenaAllocated<Padawan> {
   typedef Padawan CEREAL_BASE_TYPE;
 
   uint64_t ms;